@@ -0,0 +1,474 @@
+#include "pch.h"
+#include "ssbtree.h"
+
+using namespace std;
+using namespace tt_core_ns;
+
+namespace structuredstorage_ns
+{
+    BTree::BTree()
+        :m_ss(nullptr)
+        ,m_streamid(-1)
+        ,m_nodeSize(0)
+        ,m_leafCapacity(0)
+        ,m_internalCapacity(0)
+    {
+
+    }
+
+    int BTree::Open(StructuredStorage& ss, const char *name)
+    {
+        m_ss = &ss;
+        // Fails if the storage is not open, before its page size is used
+        int r = ss.OpenStream(name, m_streamid);
+        if (r != SS_SUCCESS && r != SS_NOT_FOUND)
+            return r;
+        m_nodeSize = ss.PageDataSize();
+        m_leafCapacity = (m_nodeSize - sizeof(nodeheader)) / (sizeof(keyslot) + sizeof(valueslot));
+        m_internalCapacity = (m_nodeSize - sizeof(nodeheader) - sizeof(Position)) / (sizeof(keyslot) + sizeof(Position));
+        if (m_leafCapacity < 3 || m_internalCapacity < 3)
+        {
+            return SS_BAD_PAGESIZE;
+        }
+        m_buffer.resize(m_nodeSize);
+
+        if (r == SS_NOT_FOUND)
+        {
+            r = ss.CreateStream(name, m_streamid);
+            if (r != SS_SUCCESS)
+                return r;
+            // The meta node takes the first page, the empty root leaf the second
+            r = ss.FilePosition(m_streamid, m_metaPos);
+            if (r != SS_SUCCESS)
+                return r;
+            memset(&m_buffer[0], 0, m_nodeSize);
+            r = ss.Write(m_streamid, &m_buffer[0], m_nodeSize);
+            if (r != SS_SUCCESS)
+                return r;
+            m_meta.magic = BTREE_MAGIC;
+            m_meta.nodeSize = m_nodeSize;
+            r = ss.FilePosition(m_streamid, m_meta.end);
+            if (r != SS_SUCCESS)
+                return r;
+            Node root;
+            root.leaf = true;
+            root.hasNext = false;
+            r = allocNode(root, m_meta.root);
+            if (r != SS_SUCCESS)
+                return r;
+            return writeMeta();
+        }
+        if (r != SS_SUCCESS)
+            return r;
+
+        r = ss.StreamSeek(m_streamid, 0);
+        if (r != SS_SUCCESS)
+            return r;
+        r = ss.FilePosition(m_streamid, m_metaPos);
+        if (r != SS_SUCCESS)
+            return r;
+        int bytesRead;
+        r = ss.Read(m_streamid, (char *)&m_meta, sizeof(metanode), bytesRead);
+        if (r != SS_SUCCESS)
+            return r;
+        if (m_meta.magic != BTREE_MAGIC || m_meta.nodeSize != m_nodeSize)
+        {
+            return SS_ERROR;
+        }
+        return SS_SUCCESS;
+    }
+
+    int BTree::Put(const char *key, int keyLen, const char *value, int valueLen)
+    {
+        if (keyLen < 0 || valueLen < 0)
+        {
+            return SS_ERROR;
+        }
+        if (keyLen > MAX_KEY || valueLen > MAX_VALUE)
+        {
+            return SS_TOO_LARGE;
+        }
+        keyslot k;
+        makeKey(key, keyLen, k);
+        valueslot v;
+        memset(&v, 0, sizeof(v));
+        v.len = (unsigned char)valueLen;
+        memcpy(v.bytes, value, valueLen);
+
+        std::vector<Position> path;
+        Node leaf;
+        Position pos;
+        int r = findLeaf(k, leaf, pos, &path);
+        if (r != SS_SUCCESS)
+            return r;
+        bool found;
+        int idx = search(leaf, k, found);
+        if (found)
+        {
+            leaf.values[idx] = v;
+            return writeNode(pos, leaf);
+        }
+        leaf.keys.insert(leaf.keys.begin() + idx, k);
+        leaf.values.insert(leaf.values.begin() + idx, v);
+        if ((int)leaf.keys.size() <= m_leafCapacity)
+        {
+            return writeNode(pos, leaf);
+        }
+
+        // Split, the upper half moves to a new leaf and its first key is copied up
+        int mid = (int)leaf.keys.size() / 2;
+        Node right;
+        right.leaf = true;
+        right.keys.assign(leaf.keys.begin() + mid, leaf.keys.end());
+        right.values.assign(leaf.values.begin() + mid, leaf.values.end());
+        right.hasNext = leaf.hasNext;
+        right.next = leaf.next;
+        leaf.keys.resize(mid);
+        leaf.values.resize(mid);
+        Position rightPos;
+        r = allocNode(right, rightPos);
+        if (r != SS_SUCCESS)
+            return r;
+        leaf.hasNext = true;
+        leaf.next = rightPos;
+        r = writeNode(pos, leaf);
+        if (r != SS_SUCCESS)
+            return r;
+        return insertInParent(path, pos, right.keys[0], rightPos);
+    }
+
+    int BTree::Get(const char *key, int keyLen, char *value, int& valueLen)
+    {
+        if (keyLen < 0)
+        {
+            return SS_ERROR;
+        }
+        if (keyLen > MAX_KEY)
+        {
+            return SS_NOT_FOUND;
+        }
+        keyslot k;
+        makeKey(key, keyLen, k);
+        Node leaf;
+        Position pos;
+        int r = findLeaf(k, leaf, pos, nullptr);
+        if (r != SS_SUCCESS)
+            return r;
+        bool found;
+        int idx = search(leaf, k, found);
+        if (!found)
+        {
+            return SS_NOT_FOUND;
+        }
+        valueLen = leaf.values[idx].len;
+        memcpy(value, leaf.values[idx].bytes, valueLen);
+        return SS_SUCCESS;
+    }
+
+    int BTree::Delete(const char *key, int keyLen)
+    {
+        if (keyLen < 0)
+        {
+            return SS_ERROR;
+        }
+        if (keyLen > MAX_KEY)
+        {
+            return SS_NOT_FOUND;
+        }
+        keyslot k;
+        makeKey(key, keyLen, k);
+        Node leaf;
+        Position pos;
+        int r = findLeaf(k, leaf, pos, nullptr);
+        if (r != SS_SUCCESS)
+            return r;
+        bool found;
+        int idx = search(leaf, k, found);
+        if (!found)
+        {
+            return SS_NOT_FOUND;
+        }
+        leaf.keys.erase(leaf.keys.begin() + idx);
+        leaf.values.erase(leaf.values.begin() + idx);
+        return writeNode(pos, leaf);
+    }
+
+    int BTree::Scan(const char *from, int fromLen, const char *to, int toLen, const scanfn_t& fn)
+    {
+        if (fromLen < 0 || (to && toLen < 0))
+        {
+            return SS_ERROR;
+        }
+        if (fromLen > MAX_KEY)
+        {
+            return SS_TOO_LARGE;
+        }
+        keyslot fromKey;
+        makeKey(from, fromLen, fromKey);
+        keyslot toKey;
+        if (to)
+        {
+            if (toLen > MAX_KEY)
+                return SS_TOO_LARGE;
+            makeKey(to, toLen, toKey);
+        }
+
+        Node leaf;
+        Position pos;
+        int r = findLeaf(fromKey, leaf, pos, nullptr);
+        if (r != SS_SUCCESS)
+            return r;
+        bool found;
+        int idx = search(leaf, fromKey, found);
+        while (true)
+        {
+            for (int i = idx; i < (int)leaf.keys.size(); i++)
+            {
+                if (to && compare(leaf.keys[i], toKey) >= 0)
+                    return SS_SUCCESS;
+                if (!fn(leaf.keys[i].bytes, leaf.keys[i].len, leaf.values[i].bytes, leaf.values[i].len))
+                    return SS_SUCCESS;
+            }
+            if (!leaf.hasNext)
+                break;
+            Position next = leaf.next;
+            r = readNode(next, leaf);
+            if (r != SS_SUCCESS)
+                return r;
+            idx = 0;
+        }
+        return SS_SUCCESS;
+    }
+
+/****************************************************************************
+* Internal implementaion methods
+*/
+    int BTree::compare(const keyslot& a, const keyslot& b)
+    {
+        int len = a.len < b.len ? a.len : b.len;
+        int c = memcmp(a.bytes, b.bytes, len);
+        if (c != 0)
+            return c;
+        return (int)a.len - (int)b.len;
+    }
+
+    void BTree::makeKey(const char *key, int keyLen, keyslot& slot)
+    {
+        TT_ASSERT(keyLen >= 0 && keyLen <= MAX_KEY);
+        memset(&slot, 0, sizeof(slot));
+        slot.len = (unsigned char)keyLen;
+        if (keyLen)
+        {
+            memcpy(slot.bytes, key, keyLen);
+        }
+    }
+
+    // Index of the first key >= key, found is set if it is equal
+    int BTree::search(const Node& node, const keyslot& key, bool& found) const
+    {
+        int lo = 0;
+        int hi = (int)node.keys.size();
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (compare(node.keys[mid], key) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        found = lo < (int)node.keys.size() && compare(node.keys[lo], key) == 0;
+        return lo;
+    }
+
+    // Walk down from the root to the leaf that holds, or would hold, key.
+    // If path is given the internal nodes visited are pushed on it, root first
+    int BTree::findLeaf(const keyslot& key, Node& leaf, Position& pos, std::vector<Position> *path)
+    {
+        pos = m_meta.root;
+        int r = readNode(pos, leaf);
+        if (r != SS_SUCCESS)
+            return r;
+        while (!leaf.leaf)
+        {
+            if (path)
+            {
+                path->push_back(pos);
+            }
+            // Keys equal to a separator live to its right
+            bool found;
+            int idx = search(leaf, key, found);
+            if (found)
+                ++idx;
+            pos = leaf.children[idx];
+            r = readNode(pos, leaf);
+            if (r != SS_SUCCESS)
+                return r;
+        }
+        return SS_SUCCESS;
+    }
+
+    int BTree::readNode(const Position& pos, Node& node)
+    {
+        int r = m_ss->FileSeek(m_streamid, pos);
+        if (r != SS_SUCCESS)
+            return r;
+        int bytesRead;
+        r = m_ss->Read(m_streamid, &m_buffer[0], m_nodeSize, bytesRead);
+        if (r != SS_SUCCESS)
+            return r;
+
+        const char *p = &m_buffer[0];
+        nodeheader header;
+        memcpy(&header, p, sizeof(header));
+        p += sizeof(header);
+        node.leaf = header.leaf != 0;
+        node.hasNext = header.hasNext != 0;
+        node.next = header.next;
+        node.keys.resize(header.count);
+        if (header.count)
+        {
+            memcpy(&node.keys[0], p, header.count * sizeof(keyslot));
+            p += header.count * sizeof(keyslot);
+        }
+        if (node.leaf)
+        {
+            node.values.resize(header.count);
+            if (header.count)
+            {
+                memcpy(&node.values[0], p, header.count * sizeof(valueslot));
+            }
+            node.children.clear();
+        }
+        else
+        {
+            node.children.resize(header.count + 1);
+            memcpy(&node.children[0], p, (header.count + 1) * sizeof(Position));
+            node.values.clear();
+        }
+        return SS_SUCCESS;
+    }
+
+    // Encode node into m_buffer and write it over the node at pos
+    int BTree::writeNode(const Position& pos, const Node& node)
+    {
+        memset(&m_buffer[0], 0, m_nodeSize);
+        char *p = &m_buffer[0];
+        nodeheader header;
+        memset(&header, 0, sizeof(header));
+        header.leaf = node.leaf ? 1 : 0;
+        header.count = (int)node.keys.size();
+        header.hasNext = node.hasNext ? 1 : 0;
+        if (node.hasNext)
+        {
+            header.next = node.next;
+        }
+        memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+        if (header.count)
+        {
+            memcpy(p, &node.keys[0], header.count * sizeof(keyslot));
+            p += header.count * sizeof(keyslot);
+        }
+        if (node.leaf)
+        {
+            if (header.count)
+            {
+                memcpy(p, &node.values[0], header.count * sizeof(valueslot));
+            }
+        }
+        else
+        {
+            memcpy(p, &node.children[0], (header.count + 1) * sizeof(Position));
+        }
+
+        int r = m_ss->FileSeek(m_streamid, pos);
+        if (r != SS_SUCCESS)
+            return r;
+        return m_ss->Write(m_streamid, &m_buffer[0], m_nodeSize);
+    }
+
+    // Append node to the stream. Nodes are exactly one page, so the new node
+    // is the page following the previous end of the stream
+    int BTree::allocNode(const Node& node, Position& pos)
+    {
+        Position last = m_meta.end;
+        int r = writeNode(last, node);
+        if (r != SS_SUCCESS)
+            return r;
+        r = m_ss->FilePosition(m_streamid, m_meta.end);
+        if (r != SS_SUCCESS)
+            return r;
+        // The old end is the end of a full page that now has a next page, for
+        // which FilePosition() gives the start of the page holding the new node
+        r = m_ss->FileSeek(m_streamid, last);
+        if (r != SS_SUCCESS)
+            return r;
+        r = m_ss->FilePosition(m_streamid, pos);
+        if (r != SS_SUCCESS)
+            return r;
+        return writeMeta();
+    }
+
+    int BTree::writeMeta()
+    {
+        int r = m_ss->FileSeek(m_streamid, m_metaPos);
+        if (r != SS_SUCCESS)
+            return r;
+        return m_ss->Write(m_streamid, (const char *)&m_meta, sizeof(metanode));
+    }
+
+    // right was split off left with key as the first key of right, add it to the
+    // parent of left, which is the last node on path
+    int BTree::insertInParent(std::vector<Position>& path, const Position& left, const keyslot& key, const Position& right)
+    {
+        int r;
+        if (path.empty())
+        {
+            // left was the root, the tree grows a level
+            Node root;
+            root.leaf = false;
+            root.hasNext = false;
+            root.keys.push_back(key);
+            root.children.push_back(left);
+            root.children.push_back(right);
+            r = allocNode(root, m_meta.root);
+            if (r != SS_SUCCESS)
+                return r;
+            return writeMeta();
+        }
+
+        Position parentPos = path.back();
+        path.pop_back();
+        Node parent;
+        r = readNode(parentPos, parent);
+        if (r != SS_SUCCESS)
+            return r;
+        bool found;
+        int idx = search(parent, key, found);
+        parent.keys.insert(parent.keys.begin() + idx, key);
+        parent.children.insert(parent.children.begin() + idx + 1, right);
+        if ((int)parent.keys.size() <= m_internalCapacity)
+        {
+            return writeNode(parentPos, parent);
+        }
+
+        // Split, the middle key moves up
+        int mid = (int)parent.keys.size() / 2;
+        keyslot up = parent.keys[mid];
+        Node sibling;
+        sibling.leaf = false;
+        sibling.hasNext = false;
+        sibling.keys.assign(parent.keys.begin() + mid + 1, parent.keys.end());
+        sibling.children.assign(parent.children.begin() + mid + 1, parent.children.end());
+        parent.keys.resize(mid);
+        parent.children.resize(mid + 1);
+        Position siblingPos;
+        r = allocNode(sibling, siblingPos);
+        if (r != SS_SUCCESS)
+            return r;
+        r = writeNode(parentPos, parent);
+        if (r != SS_SUCCESS)
+            return r;
+        return insertInParent(path, parentPos, up, siblingPos);
+    }
+}
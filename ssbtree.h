@@ -0,0 +1,116 @@
+#pragma once
+
+#ifndef __IDEMPOTENT_TRANSACTION_COUNTING_SSBTREE_H_
+#define __IDEMPOTENT_TRANSACTION_COUNTING_SSBTREE_H_
+
+#include "sstorage.h"
+#include <functional>
+
+namespace structuredstorage_ns
+{
+    // A B+tree of key/value pairs kept in a stream of a StructuredStorage.
+    // Every node is exactly one page of the stream and nodes refer to each other
+    // by Position, so a lookup costs one FileSeek per level of the tree.
+    // Keys compare as unsigned bytes, shorter key first on a tie.
+    //
+    // Delete() does not merge underfull nodes, a leaf may become empty.
+    class BTree
+    {
+    public:
+        enum
+        {
+            MAX_KEY = 32,
+            MAX_VALUE = 32,
+        };
+
+        // Called for each pair by Scan(), return false to stop the scan
+        typedef std::function<bool(const char *key, int keyLen, const char *value, int valueLen)> scanfn_t;
+
+        BTree();
+
+        // Open the tree kept in the named stream, creating the stream if needed.
+        // The storage must stay open while the tree is used
+        int Open(StructuredStorage& ss, const char *name);
+
+        // Insert or replace the value for key. Negative lengths here and below
+        // fail with SS_ERROR
+        int Put(const char *key, int keyLen, const char *value, int valueLen);
+
+        // Get the value for key. value MUST point to a buffer of MAX_VALUE bytes
+        int Get(const char *key, int keyLen, char *value, int& valueLen);
+
+        // Remove key, SS_NOT_FOUND if it is not there
+        int Delete(const char *key, int keyLen);
+
+        // Call fn for each pair with from <= key < to, in key order. A null
+        // to scans to the end of the tree
+        int Scan(const char *from, int fromLen, const char *to, int toLen, const scanfn_t& fn);
+    private:
+        enum
+        {
+            BTREE_MAGIC = 0xff783447,
+        };
+
+        struct keyslot
+        {
+            unsigned char len;
+            char bytes[MAX_KEY];
+        };
+
+        struct valueslot
+        {
+            unsigned char len;
+            char bytes[MAX_VALUE];
+        };
+
+        // First node of the stream
+        struct metanode
+        {
+            int magic;
+            int nodeSize;
+            Position root;
+            Position end;           // End of the stream, where the next node is appended
+        };
+
+        // On disk a node is a nodeheader followed by count keyslots then, for a leaf,
+        // count valueslots, or, for an internal node, count+1 child Positions
+        struct nodeheader
+        {
+            int leaf;
+            int count;
+            int hasNext;
+            Position next;          // Next leaf, for Scan()
+        };
+
+        struct Node
+        {
+            bool leaf;
+            std::vector<keyslot> keys;
+            std::vector<valueslot> values;  // Leaf only
+            std::vector<Position> children; // Internal only, keys.size()+1 of them
+            bool hasNext;
+            Position next;
+        };
+
+        StructuredStorage *m_ss;
+        int m_streamid;
+        int m_nodeSize;
+        int m_leafCapacity;         // Max keys in a leaf
+        int m_internalCapacity;     // Max keys in an internal node
+        metanode m_meta;
+        Position m_metaPos;
+        std::vector<char> m_buffer; // One node
+    private:
+        static int compare(const keyslot& a, const keyslot& b);
+        static void makeKey(const char *key, int keyLen, keyslot& slot);
+        int search(const Node& node, const keyslot& key, bool& found) const;
+        int findLeaf(const keyslot& key, Node& leaf, Position& pos, std::vector<Position> *path);
+        int readNode(const Position& pos, Node& node);
+        int writeNode(const Position& pos, const Node& node);
+        int allocNode(const Node& node, Position& pos);
+        int writeMeta();
+        int insertInParent(std::vector<Position>& path, const Position& left, const keyslot& key, const Position& right);
+    };
+}
+
+#endif // __IDEMPOTENT_TRANSACTION_COUNTING_SSBTREE_H_
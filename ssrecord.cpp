@@ -0,0 +1,216 @@
+#include "pch.h"
+#include "ssrecord.h"
+
+using namespace std;
+using namespace tt_core_ns;
+
+namespace structuredstorage_ns
+{
+    RecordStream::RecordStream()
+        :m_ss(nullptr)
+        ,m_streamid(-1)
+        ,m_indexid(-1)
+        ,m_interval(DEFAULT_INDEX_INTERVAL)
+        ,m_count(0)
+        ,m_current(0)
+    {
+
+    }
+
+    int RecordStream::Open(StructuredStorage& ss, const char *name, int indexInterval)
+    {
+        char indexName[64];
+        if (strlen(name) + 4 >= 32)
+        {
+            // The index stream name must fit in MAX_STREAM_NAME
+            return SS_TOO_LARGE;
+        }
+        if (indexInterval < 1)
+        {
+            return SS_ERROR;
+        }
+        sprintf(indexName, "%s.idx", name);
+        m_ss = &ss;
+        m_index.clear();
+        m_count = 0;
+        m_current = 0;
+
+        int r = ss.OpenStream(name, m_streamid);
+        if (r == SS_NOT_FOUND)
+        {
+            r = ss.CreateStream(name, m_streamid);
+            if (r != SS_SUCCESS)
+                return r;
+            r = ss.CreateStream(indexName, m_indexid);
+            if (r != SS_SUCCESS)
+                return r;
+            // The index stream starts with the interval
+            m_interval = indexInterval;
+            r = ss.Write(m_indexid, (const char *)&m_interval, sizeof(m_interval));
+            if (r != SS_SUCCESS)
+                return r;
+            return ss.FilePosition(m_streamid, m_end);
+        }
+        if (r != SS_SUCCESS)
+            return r;
+        r = ss.OpenStream(indexName, m_indexid);
+        if (r != SS_SUCCESS)
+            return r;
+
+        // Load the index, which leaves the index stream at its end for appending
+        int bytesRead;
+        r = ss.StreamSeek(m_indexid, 0);
+        if (r != SS_SUCCESS)
+            return r;
+        r = ss.Read(m_indexid, (char *)&m_interval, sizeof(m_interval), bytesRead);
+        if (r != SS_SUCCESS)
+            return r;
+        Position pos;
+        while (ss.Read(m_indexid, (char *)&pos, sizeof(pos), bytesRead) == SS_SUCCESS)
+        {
+            m_index.push_back(pos);
+        }
+
+        // Count the records after the last indexed one
+        if (m_index.empty())
+        {
+            r = ss.StreamSeek(m_streamid, 0);
+        }
+        else
+        {
+            r = ss.FileSeek(m_streamid, m_index.back());
+            m_count = ((int)m_index.size() - 1) * m_interval;
+        }
+        if (r != SS_SUCCESS)
+            return r;
+        while ((r = skipRecord()) == SS_SUCCESS)
+        {
+            ++m_count;
+        }
+        if (r != SS_EOF)
+            return r;
+        m_current = m_count;
+        return ss.FilePosition(m_streamid, m_end);
+    }
+
+    int RecordStream::AppendRecord(const char *buf, int len)
+    {
+        if (len < 0)
+        {
+            return SS_ERROR;
+        }
+        int r = m_ss->FileSeek(m_streamid, m_end);
+        if (r != SS_SUCCESS)
+            return r;
+        if (m_count % m_interval == 0)
+        {
+            Position pos;
+            r = m_ss->FilePosition(m_streamid, pos);
+            if (r != SS_SUCCESS)
+                return r;
+            r = m_ss->Write(m_indexid, (const char *)&pos, sizeof(pos));
+            if (r != SS_SUCCESS)
+                return r;
+            m_index.push_back(pos);
+        }
+        r = m_ss->Write(m_streamid, (const char *)&len, sizeof(len));
+        if (r != SS_SUCCESS)
+            return r;
+        r = m_ss->Write(m_streamid, buf, len);
+        if (r != SS_SUCCESS)
+            return r;
+        ++m_count;
+        m_current = m_count;
+        return m_ss->FilePosition(m_streamid, m_end);
+    }
+
+    int RecordStream::ReadRecord(char *buf, int bufSize, int& len)
+    {
+        if (m_current == m_count)
+        {
+            return SS_EOF;
+        }
+        Position start;
+        int r = m_ss->FilePosition(m_streamid, start);
+        if (r != SS_SUCCESS)
+            return r;
+        int bytesRead;
+        r = m_ss->Read(m_streamid, (char *)&len, sizeof(len), bytesRead);
+        if (r != SS_SUCCESS)
+            return r;
+        if (len < 0)
+        {
+            // Not a record length, the stream is corrupt
+            m_ss->FileSeek(m_streamid, start);
+            return SS_ERROR;
+        }
+        if (len > bufSize)
+        {
+            m_ss->FileSeek(m_streamid, start);
+            return SS_TOO_LARGE;
+        }
+        r = m_ss->Read(m_streamid, buf, len, bytesRead);
+        if (r != SS_SUCCESS)
+            return r;
+        ++m_current;
+        return SS_SUCCESS;
+    }
+
+    int RecordStream::SeekRecord(int n)
+    {
+        if (n < 0 || n > m_count)
+        {
+            return SS_SEEK_RANGE;
+        }
+        int r;
+        if (n == m_count)
+        {
+            r = m_ss->FileSeek(m_streamid, m_end);
+            if (r != SS_SUCCESS)
+                return r;
+            m_current = n;
+            return SS_SUCCESS;
+        }
+        int indexed = n / m_interval * m_interval;
+        if (n < m_current || indexed > m_current)
+        {
+            // Reading on from where we are would be further than from the index
+            r = m_ss->FileSeek(m_streamid, m_index[n / m_interval]);
+            if (r != SS_SUCCESS)
+                return r;
+            m_current = indexed;
+        }
+        while (m_current < n)
+        {
+            r = skipRecord();
+            if (r != SS_SUCCESS)
+                return r;
+            ++m_current;
+        }
+        return SS_SUCCESS;
+    }
+
+/****************************************************************************
+* Internal implementaion methods
+*/
+    // Read past the record at the current position
+    int RecordStream::skipRecord()
+    {
+        int len;
+        int bytesRead;
+        int r = m_ss->Read(m_streamid, (char *)&len, sizeof(len), bytesRead);
+        if (r != SS_SUCCESS)
+            return r;
+        if (len < 0)
+        {
+            return SS_ERROR;
+        }
+        if ((int)m_scratch.size() < len)
+        {
+            m_scratch.resize(len);
+        }
+        if (len == 0)
+            return SS_SUCCESS;
+        return m_ss->Read(m_streamid, &m_scratch[0], len, bytesRead);
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#ifndef __IDEMPOTENT_TRANSACTION_COUNTING_SSRECORD_H_
+#define __IDEMPOTENT_TRANSACTION_COUNTING_SSRECORD_H_
+
+#include "sstorage.h"
+
+namespace structuredstorage_ns
+{
+    // A stream of variable length records. Each record is an int length followed
+    // by the record bytes. A second stream, the record stream name followed by
+    // ".idx", holds the Position of every Kth record so that SeekRecord(n) is a
+    // FileSeek plus reading past at most K-1 records.
+    //
+    // Records are only appended. The index is read into memory by Open().
+    class RecordStream
+    {
+    public:
+        enum
+        {
+            DEFAULT_INDEX_INTERVAL = 64,
+        };
+
+        RecordStream();
+
+        // Open the named record stream, creating it with the given index interval
+        // if it does not exist. An existing stream keeps the interval it was
+        // created with. The storage must stay open while the stream is used
+        int Open(StructuredStorage& ss, const char *name, int indexInterval = DEFAULT_INDEX_INTERVAL);
+
+        // Append a record at the end of the stream, and leave the stream at the end
+        int AppendRecord(const char *buf, int len);
+
+        // Read the next record. If bufSize is too small returns SS_TOO_LARGE with
+        // len set to the size needed, and stays on that record
+        int ReadRecord(char *buf, int bufSize, int& len);
+
+        // Position the stream so that the next ReadRecord() reads record n
+        int SeekRecord(int n);
+
+        // Number of records in the stream
+        int RecordCount() const { return m_count; }
+
+        // Number of the record the next ReadRecord() reads
+        int RecordNumber() const { return m_current; }
+    private:
+        StructuredStorage *m_ss;
+        int m_streamid;
+        int m_indexid;
+        int m_interval;
+        int m_count;
+        int m_current;
+        Position m_end;                 // End of the record stream
+        std::vector<Position> m_index;  // Position of record i*m_interval
+        std::vector<char> m_scratch;    // For reading past records
+    private:
+        int skipRecord();
+    };
+}
+
+#endif // __IDEMPOTENT_TRANSACTION_COUNTING_SSRECORD_H_
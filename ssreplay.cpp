@@ -0,0 +1,480 @@
+// ssreplay - replay a trace written by StructuredStorage::StartTrace() against a fresh storage
+//
+// ssreplay [-t] [-p pageSize] [-s stripes] [-w maxDirtyPages] tracefile storagefile
+//   -t    keep the recorded time between calls, otherwise replay as fast as possible
+//   -p    page size to use when the trace does not start with CreateStorage
+//   -s    stripes to use when the trace was started on an open storage
+//   -w    replay in write-back mode, see StructuredStorage::SetWriteBack(). The trace's
+//         own SetWriteBack calls are then skipped
+//
+// A striped storage is replayed on storagefile, storagefile.1, storagefile.2 and so on.
+// Streams are named after their trace ids and written with a synthetic payload.
+// Streams that existed before the trace was started are created with their
+// recorded sizes before the replay starts timing.
+// Reports per call latency and read/write throughput.
+
+#include "pch.h"
+#include "sstorage.h"
+#include "sstrace.h"
+#include <io.h>
+#include <fcntl.h>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <string>
+#include <cstdio>
+
+using namespace std;
+using namespace structuredstorage_ns;
+
+namespace
+{
+    long long nowMicroseconds()
+    {
+        return chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    struct opstats
+    {
+        opstats() :count(0), bytes(0), replayMicros(0), traceMicros(0), mismatches(0) {}
+        long long count;
+        long long bytes;
+        long long replayMicros;
+        long long traceMicros;
+        long long mismatches;           // Return code differs from the trace
+        std::vector<unsigned int> latencies;
+    };
+
+    const char *opName(int op)
+    {
+        switch (op)
+        {
+        case TRACE_CREATE_STORAGE: return "CreateStorage";
+        case TRACE_OPEN_STORAGE: return "OpenStorage";
+        case TRACE_CLOSE_STORAGE: return "CloseStorage";
+        case TRACE_CREATE_STREAM: return "CreateStream";
+        case TRACE_OPEN_STREAM: return "OpenStream";
+        case TRACE_READ: return "Read";
+        case TRACE_WRITE: return "Write";
+        case TRACE_STREAM_SEEK: return "StreamSeek";
+        case TRACE_STREAM_POSITION: return "StreamPosition";
+        case TRACE_FILE_SEEK: return "FileSeek";
+        case TRACE_FILE_POSITION: return "FilePosition";
+        case TRACE_CLONE_STREAM: return "CloneStream";
+        case TRACE_SET_WRITE_BACK: return "SetWriteBack";
+        case TRACE_FLUSH_WRITE_BACK: return "FlushWriteBack";
+        case TRACE_SET_IDLE_RELEASE: return "SetIdleRelease";
+        case TRACE_RELEASE_IDLE_BUFFERS: return "ReleaseIdleBuffers";
+        }
+        return "Unknown";
+    }
+
+    unsigned int percentile(std::vector<unsigned int>& v, int pct)
+    {
+        if (v.empty())
+            return 0;
+        size_t i = (v.size() - 1) * pct / 100;
+        std::nth_element(v.begin(), v.begin() + i, v.end());
+        return v[i];
+    }
+
+    // Create the streams that existed before the trace was started, filled with
+    // synthetic bytes up to their recorded size
+    int prefill(StructuredStorage& storage, const std::map<int, tracerecord>& existing,
+        std::map<int, int>& streams, bool seek)
+    {
+        std::vector<char> fill(65536, 'x');
+        std::map<int, tracerecord>::const_iterator it = existing.begin();
+        std::map<int, tracerecord>::const_iterator eit = existing.end();
+        while (it != eit)
+        {
+            const tracerecord& rec = (*it).second;
+            char name[32];
+            sprintf(name, "s%d", rec.streamid);
+            int replayid;
+            int r = storage.CreateStream(name, replayid);
+            if (r != SS_SUCCESS)
+                return r;
+            for (int written = 0; written < rec.arg; written += (int)fill.size())
+            {
+                int n = rec.arg - written < (int)fill.size() ? rec.arg - written : (int)fill.size();
+                r = storage.Write(replayid, &fill[0], n);
+                if (r != SS_SUCCESS)
+                    return r;
+            }
+            if (seek)
+            {
+                r = storage.StreamSeek(replayid, rec.arg2);
+                if (r != SS_SUCCESS)
+                    return r;
+            }
+            streams[rec.streamid] = replayid;
+            ++it;
+        }
+        return SS_SUCCESS;
+    }
+
+    // Stripes of a CreateStorage or OpenStorage record, traces before version 3 have one
+    int recordStripes(const traceheader& header, const tracerecord& rec)
+    {
+        return header.version >= 3 && rec.streamid > 1 ? rec.streamid : 1;
+    }
+
+    // Files to replay a storage of count stripes on, see the top of the file
+    std::vector<const char *> stripeFiles(const char *storagefile, int count, std::vector<std::string>& names)
+    {
+        names.clear();
+        names.push_back(storagefile);
+        for (int i = 1; i < count; i++)
+        {
+            char suffix[16];
+            sprintf(suffix, ".%d", i);
+            names.push_back(std::string(storagefile) + suffix);
+        }
+        std::vector<const char *> files;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            files.push_back(names[i].c_str());
+        }
+        return files;
+    }
+
+    void usage()
+    {
+        fprintf(stderr, "usage: ssreplay [-t] [-p pageSize] [-s stripes] [-w maxDirtyPages] tracefile storagefile\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool timed = false;
+    int pageSize = 1024;
+    int stripes = 1;
+    int writeBack = 0;
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-')
+    {
+        if (strcmp(argv[argi], "-t") == 0)
+        {
+            timed = true;
+        }
+        else if (strcmp(argv[argi], "-p") == 0 && argi + 1 < argc)
+        {
+            pageSize = atoi(argv[++argi]);
+        }
+        else if (strcmp(argv[argi], "-s") == 0 && argi + 1 < argc)
+        {
+            stripes = atoi(argv[++argi]);
+        }
+        else if (strcmp(argv[argi], "-w") == 0 && argi + 1 < argc)
+        {
+            writeBack = atoi(argv[++argi]);
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+        ++argi;
+    }
+    if (argc - argi != 2)
+    {
+        usage();
+        return 1;
+    }
+    const char *tracefile = argv[argi];
+    const char *storagefile = argv[argi + 1];
+
+    int fd = _open(tracefile, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ssreplay: cannot open %s\n", tracefile);
+        return 1;
+    }
+    traceheader header;
+    if (_read(fd, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != TRACE_MAGIC || header.version < 1 || header.version > TRACE_VERSION ||
+        header.recordSize != sizeof(tracerecord))
+    {
+        fprintf(stderr, "ssreplay: %s is not a trace file\n", tracefile);
+        _close(fd);
+        return 1;
+    }
+    std::vector<tracerecord> records;
+    tracerecord rec;
+    while (_read(fd, &rec, sizeof(rec)) == sizeof(rec))
+    {
+        records.push_back(rec);
+    }
+    _close(fd);
+
+    // Find what the trace expects to exist before its first call: the streams
+    // recorded by StartTrace(), and the ones it opens without creating them
+    int firstStorageOp = 0;
+    int firstOptions = 0;
+    std::map<int, tracerecord> existing;    // trace streamid, size and position
+    std::map<int, bool> made;               // trace streamid, created in the trace
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const tracerecord& record = records[i];
+        if (firstStorageOp == 0 && (record.op == TRACE_CREATE_STORAGE ||
+            record.op == TRACE_OPEN_STORAGE || record.op == TRACE_CLOSE_STORAGE))
+        {
+            firstStorageOp = record.op;
+            firstOptions = record.arg2;
+            if (record.op == TRACE_OPEN_STORAGE)
+            {
+                stripes = recordStripes(header, record);
+            }
+        }
+        if (record.op == TRACE_CREATE_STREAM && record.streamid >= 0)
+        {
+            made[record.streamid] = true;
+        }
+        else if (record.op == TRACE_CLONE_STREAM && record.arg >= 0)
+        {
+            made[record.arg] = true;
+        }
+        else if ((record.op == TRACE_STREAM_STATE || (record.op == TRACE_OPEN_STREAM && header.version >= 2))
+            && record.streamid >= 0 && made.find(record.streamid) == made.end()
+            && existing.find(record.streamid) == existing.end())
+        {
+            existing[record.streamid] = record;
+        }
+    }
+
+    StructuredStorage storage;
+    std::vector<std::string> names;
+    std::vector<const char *> files;
+    bool created = false;
+    std::map<int, int> streams;         // trace streamid, replay streamid
+    if (firstStorageOp != TRACE_CREATE_STORAGE)
+    {
+        // A trace that starts with OpenStorage gets a storage to open, one that
+        // was started on an open storage gets it open and positioned
+        bool opened = firstStorageOp != TRACE_OPEN_STORAGE;
+        files = stripeFiles(storagefile, stripes, names);
+        int r = storage.CreateStripedStorage(&files[0], (int)files.size(), pageSize, opened ? 0 : firstOptions);
+        if (r == SS_SUCCESS)
+        {
+            r = prefill(storage, existing, streams, opened);
+        }
+        if (r != SS_SUCCESS)
+        {
+            fprintf(stderr, "ssreplay: cannot set up %s, error %d\n", storagefile, r);
+            return 1;
+        }
+        if (!opened)
+        {
+            storage.CloseStorage();
+            streams.clear();
+        }
+        else if (writeBack > 0)
+        {
+            storage.SetWriteBack(writeBack);
+        }
+        created = true;
+    }
+
+    std::vector<Position> positions;    // indexed by position token
+    std::vector<char> payload;
+    std::map<int, opstats> stats;       // op, stats
+    long long replayStart = nowMicroseconds();
+    long long traceClock = 0;           // Start of the current record, relative to the trace
+    long long firstStart = -1;
+
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        rec = records[i];
+        if (rec.op == TRACE_STREAM_STATE)
+        {
+            continue;       // Set up above
+        }
+        if (firstStart < 0)
+        {
+            // The first delta is from StartTrace, not from a call
+            firstStart = rec.startDelta;
+        }
+        traceClock += rec.startDelta;
+        if (timed)
+        {
+            long long due = replayStart + traceClock - firstStart;
+            long long now = nowMicroseconds();
+            if (due > now)
+            {
+                this_thread::sleep_for(chrono::microseconds(due - now));
+            }
+        }
+
+        int replayid = -1;
+        std::map<int, int>::iterator sit = streams.find(rec.streamid);
+        if (sit != streams.end())
+        {
+            replayid = (*sit).second;
+        }
+        char name[32];
+        sprintf(name, "s%d", rec.streamid);
+        long long bytes = 0;
+        int r = SS_SUCCESS;
+
+        long long start = nowMicroseconds();
+        switch (rec.op)
+        {
+        case TRACE_CREATE_STORAGE:
+            files = stripeFiles(storagefile, recordStripes(header, rec), names);
+            r = storage.CreateStripedStorage(&files[0], (int)files.size(), rec.arg, rec.arg2);
+            created = true;
+            break;
+        case TRACE_OPEN_STORAGE:
+            // A trace taken on an existing storage starts with an empty one here
+            files = stripeFiles(storagefile, recordStripes(header, rec), names);
+            if (created)
+            {
+                r = storage.OpenStripedStorage(&files[0], (int)files.size(), rec.arg2);
+            }
+            else
+            {
+                r = storage.CreateStripedStorage(&files[0], (int)files.size(), pageSize, rec.arg2);
+                created = true;
+            }
+            break;
+        case TRACE_CLOSE_STORAGE:
+            r = storage.CloseStorage();
+            positions.clear();
+            break;
+        case TRACE_CREATE_STREAM:
+        case TRACE_OPEN_STREAM:
+            if (rec.streamid < 0)
+                continue;       // Failed in the trace, nothing to map
+            r = rec.op == TRACE_CREATE_STREAM ? storage.CreateStream(name, replayid)
+                                              : storage.OpenStream(name, replayid);
+            if (r == SS_NOT_FOUND)
+            {
+                // Stream existed before the trace was started
+                r = storage.CreateStream(name, replayid);
+            }
+            if (r == SS_SUCCESS)
+            {
+                streams[rec.streamid] = replayid;
+            }
+            break;
+        case TRACE_CLONE_STREAM:
+            if (rec.arg < 0)
+                continue;       // Failed in the trace, nothing to map
+            {
+                int cloneid;
+                sprintf(name, "s%d", rec.arg);
+                r = storage.CloneStream(replayid, name, cloneid);
+                if (r == SS_SUCCESS)
+                {
+                    streams[rec.arg] = cloneid;
+                }
+            }
+            break;
+        case TRACE_READ:
+            if ((int)payload.size() < rec.arg)
+            {
+                payload.resize(rec.arg, 'x');
+            }
+            {
+                int bytesRead = 0;
+                r = storage.Read(replayid, payload.empty() ? nullptr : &payload[0], rec.arg, bytesRead);
+                bytes = bytesRead;
+            }
+            break;
+        case TRACE_WRITE:
+            if ((int)payload.size() < rec.arg)
+            {
+                payload.resize(rec.arg, 'x');
+            }
+            r = storage.Write(replayid, payload.empty() ? nullptr : &payload[0], rec.arg);
+            bytes = rec.arg;
+            break;
+        case TRACE_STREAM_SEEK:
+            r = storage.StreamSeek(replayid, rec.arg);
+            break;
+        case TRACE_STREAM_POSITION:
+            {
+                int pos;
+                r = storage.StreamPosition(replayid, pos);
+            }
+            break;
+        case TRACE_FILE_SEEK:
+            if (rec.arg < 0 || rec.arg >= (int)positions.size())
+                continue;       // Position was taken before the trace started
+            r = storage.FileSeek(replayid, positions[rec.arg]);
+            break;
+        case TRACE_FILE_POSITION:
+            {
+                Position pos;
+                r = storage.FilePosition(replayid, pos);
+                if (rec.arg == (int)positions.size())
+                {
+                    positions.push_back(pos);
+                }
+                else if (rec.arg >= 0 && rec.arg < (int)positions.size())
+                {
+                    positions[rec.arg] = pos;
+                }
+            }
+            break;
+        case TRACE_SET_WRITE_BACK:
+            if (writeBack > 0)
+                continue;
+            r = storage.SetWriteBack(rec.arg);
+            break;
+        case TRACE_FLUSH_WRITE_BACK:
+            r = storage.FlushWriteBack();
+            break;
+        case TRACE_SET_IDLE_RELEASE:
+            storage.SetIdleRelease(rec.arg);
+            break;
+        case TRACE_RELEASE_IDLE_BUFFERS:
+            r = storage.ReleaseIdleBuffers();
+            break;
+        default:
+            fprintf(stderr, "ssreplay: unknown op %d in trace\n", rec.op);
+            return 1;
+        }
+        long long elapsed = nowMicroseconds() - start;
+        if ((rec.op == TRACE_CREATE_STORAGE || rec.op == TRACE_OPEN_STORAGE) && r == SS_SUCCESS && writeBack > 0)
+        {
+            storage.SetWriteBack(writeBack);
+        }
+
+        opstats& s = stats[rec.op];
+        ++s.count;
+        s.bytes += bytes;
+        s.replayMicros += elapsed;
+        s.traceMicros += rec.duration;
+        s.latencies.push_back((unsigned int)elapsed);
+        if (r != rec.result)
+        {
+            ++s.mismatches;
+        }
+    }
+    storage.CloseStorage();
+    long long total = nowMicroseconds() - replayStart;
+
+    long long calls = 0;
+    printf("%-18s %10s %12s %10s %10s %10s %10s %10s %10s\n",
+        "call", "count", "MB/s", "avg us", "p50 us", "p99 us", "max us", "trace avg", "mismatch");
+    std::map<int, opstats>::iterator it = stats.begin();
+    std::map<int, opstats>::iterator eit = stats.end();
+    while (it != eit)
+    {
+        opstats& s = (*it).second;
+        double mbps = s.replayMicros ? (double)s.bytes / s.replayMicros : 0.0;
+        printf("%-18s %10lld %12.1f %10.1f %10u %10u %10u %10.1f %10lld\n",
+            opName((*it).first), s.count, mbps,
+            (double)s.replayMicros / s.count,
+            percentile(s.latencies, 50), percentile(s.latencies, 99), percentile(s.latencies, 100),
+            (double)s.traceMicros / s.count, s.mismatches);
+        calls += s.count;
+        ++it;
+    }
+    printf("%lld calls in %.3f s, %.0f calls/s\n", calls, total / 1e6,
+        total ? calls * 1e6 / total : 0.0);
+    return 0;
+}
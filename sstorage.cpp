@@ -1,16 +1,93 @@
 #include "pch.h"
 #include "sstorage.h"
+#include "sstrace.h"
 #include <io.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <chrono>
+#include <cstddef>
+#include <climits>
+#include <algorithm>
+
+// SS_DIRECT_IO bypasses the OS page cache with O_DIRECT, or on Windows, where the
+// CRT _open() has no equivalent, with an unbuffered handle, see openFile()
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(O_DIRECT)
+#define SS_O_DIRECT O_DIRECT
+#else
+#define SS_O_DIRECT 0   // No way to bypass the cache, only the aligned I/O pattern
+#endif
 
 using namespace std;
 using namespace tt_core_ns;
 
+namespace
+{
+    long long nowMilliseconds()
+    {
+        return chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Open a backing file, bypassing the OS page cache if direct is set
+    int openFile(const char *filename, int flags, bool direct)
+    {
+#ifdef _WIN32
+        if (direct)
+        {
+            // Unbuffered and write-through, wrapped in a CRT descriptor so the
+            // rest of the I/O stays the same
+            DWORD disposition = OPEN_EXISTING;
+            if (flags & O_CREAT)
+            {
+                disposition = (flags & O_TRUNC) ? CREATE_ALWAYS : OPEN_ALWAYS;
+            }
+            HANDLE h = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                disposition, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
+            if (h == INVALID_HANDLE_VALUE)
+            {
+                return -1;
+            }
+            int fd = _open_osfhandle((intptr_t)h, 0);
+            if (fd < 0)
+            {
+                CloseHandle(h);
+            }
+            return fd;
+        }
+#else
+        if (direct)
+        {
+            flags |= SS_O_DIRECT;
+        }
+#endif
+        return _open(filename, flags, _S_IREAD | _S_IWRITE);
+    }
+}
+
 namespace structuredstorage_ns
 {
     StructuredStorage::StructuredStorage()
         :m_fd(-1)
+        ,m_fileEnd(0)
+        ,m_pageAddressed(false)
+        ,m_pageDataSize(0)
+        ,m_aligned(false)
+        ,m_ioBuffer(nullptr)
+        ,m_idleRelease(0)
+        ,m_lastIdleScan(0)
+        ,m_cowStream(-1)
+        ,m_nextTag(FIRST_CLONE_TAG)
+        ,m_cowDirty(false)
+        ,m_writeBack(false)
+        ,m_writeBackLimit(0)
+        ,m_writeBackError(SS_SUCCESS)
+        ,m_flushBuffer(nullptr)
+        ,m_flushStop(false)
+        ,m_flushRequested(false)
+        ,m_flushOrder(nullptr)
+        ,m_writerStop(false)
     {
 
     }
@@ -18,10 +95,19 @@ namespace structuredstorage_ns
     StructuredStorage::~StructuredStorage()
     {
         CloseStorage();
+        StopTrace();
     }
 
 
     int StructuredStorage::Read(int stream, char *buf, int bytesToRead, int& bytesRead)
+    {
+        long long start = beginCall();
+        int r = readStream(stream, buf, bytesToRead, bytesRead);
+        endCall(start, TRACE_READ, r, stream, bytesToRead, bytesRead);
+        return r;
+    }
+
+    int StructuredStorage::readStream(int stream, char *buf, int bytesToRead, int& bytesRead)
     {
         if (m_fd == -1)
         {
@@ -32,6 +118,13 @@ namespace structuredstorage_ns
         if (it == m_streams.end())
             return SS_INVALID_STREAM;
         Stream& strm = (*it).second;
+        touchStream(strm);
+        if (strm.pageData == nullptr)
+        {
+            int r = loadStream(strm);
+            if (r != SS_SUCCESS)
+                return r;
+        }
         bytesRead = 0;
         while (bytesToRead)
         {
@@ -56,13 +149,24 @@ namespace structuredstorage_ns
     }
 
     int StructuredStorage::CloseStorage()
+    {
+        long long start = beginCall();
+        int r = closeStorage();
+        endCall(start, TRACE_CLOSE_STORAGE, r, 0);
+        return r;
+    }
+
+    int StructuredStorage::closeStorage()
     {
         if (m_fd == -1)
         {
             return SS_NOT_OPENED;
         }
+        flushCopyOnWrite();
         flushStreamDirectory();
-        // Write all the stream info's and current pages and data
+        // Write all the stream info's and current pages and data. The storage
+        // is closed either way, the first failure is reported
+        int result = SS_SUCCESS;
         streammap_t::iterator it = m_streams.begin();
         streammap_t::iterator eit = m_streams.end();
         while (it != eit)
@@ -70,71 +174,223 @@ namespace structuredstorage_ns
             Stream& strm = (*it).second;
             if (strm.dirty)
             {
-                writePageHeader(strm.currentPage);
-                writePageData(strm.currentPage, strm.pageData);
+                int r = writeCurrentPage(strm);
+                if (r != SS_SUCCESS && result == SS_SUCCESS)
+                    result = r;
             }
-            delete strm.pageData;
             strm.pageData = nullptr;
             ++it;
         }
 
         m_streams.clear();
+        freePagePool();
         writeStorageHeader();
+        m_cowStream = -1;
+        m_nextTag = FIRST_CLONE_TAG;
+        m_cowDirty = false;
+        int r = stopWriteBack();
+        if (result == SS_SUCCESS)
+            result = r;
 
-        _close(m_fd);
-        m_fd = -1;
-        return SS_SUCCESS;
+        closeFiles();
+        if (m_ioBuffer)
+        {
+            _aligned_free(m_ioBuffer);
+            m_ioBuffer = nullptr;
+        }
+        m_aligned = false;
+        m_pageAddressed = false;
+        m_pageDataSize = 0;
+        return result;
+    }
+
+    int StructuredStorage::OpenStorage(const char *filename, int options)
+    {
+        return OpenStripedStorage(&filename, 1, options);
+    }
+
+    int StructuredStorage::OpenStripedStorage(const char **filenames, int count, int options)
+    {
+        long long start = beginCall();
+        int r = openStripedStorage(filenames, count, options);
+        endCall(start, TRACE_OPEN_STORAGE, r, count, 0, options);
+        return r;
     }
 
-    int StructuredStorage::OpenStorage(const char *filename)
+    int StructuredStorage::openStripedStorage(const char **filenames, int count, int options)
     {
         if (m_fd != -1)
         {
             return SS_ALREADY_OPENED;
         }
-        m_fd = _open(filename, O_RDWR);
-        if (m_fd < 0)
+        if (count < 1)
         {
             return SS_ERROR;
         }
+        // The headers are always read through the cache, we don't know the
+        // layout until we have them
+        int r = openFiles(filenames, count, O_RDWR, false);
+        if (r != SS_SUCCESS)
+        {
+            return r;
+        }
         readStorageHeader();
         if (m_header.magic != MAGIC_NUM)
         {
-            _close(m_fd);
+            closeFiles();
             return SS_NOT_A_STORAGE;
         }
-        if (m_header.version != VERSION_NUM)
+        if (m_header.version != VERSION_NUM && m_header.version != VERSION_ALIGNED
+            && m_header.version != VERSION_PAGE_ADDRESSED)
         {
-            _close(m_fd);
+            closeFiles();
             return SS_UNKNOWN_VERSION;
         }
+        if (m_header.stripes != count || m_header.stripeIndex != 0)
+        {
+            closeFiles();
+            return SS_STRIPE_MISMATCH;
+        }
+        for (int i = 1; i < count; i++)
+        {
+            fileheader copy;
+            _lseek(m_fds[i], 0, SEEK_SET);
+            r = _read(m_fds[i], &copy, sizeof(copy));
+            if (r != sizeof(copy) || copy.magic != MAGIC_NUM || copy.stripes != count || copy.stripeIndex != i)
+            {
+                closeFiles();
+                return SS_STRIPE_MISMATCH;
+            }
+        }
+        m_aligned = (m_header.flags & HEADER_ALIGNED) != 0;
+        m_pageAddressed = m_header.version >= VERSION_PAGE_ADDRESSED;
+        if (options & SS_DIRECT_IO)
+        {
+            if (!m_aligned)
+            {
+                closeFiles();
+                m_aligned = false;
+                m_pageAddressed = false;
+                return SS_NOT_ALIGNED;
+            }
+            closeFiles();
+            r = openFiles(filenames, count, O_RDWR, true);
+            if (r != SS_SUCCESS)
+            {
+                m_aligned = false;
+                m_pageAddressed = false;
+                return r;
+            }
+        }
+        if (m_aligned)
+        {
+            m_ioBuffer = (char *)_aligned_malloc(m_header.pageSize, BLOCK_SIZE);
+        }
         m_pageDataSize = m_header.pageSize - sizeof(pageheader);
+
+        // Every file holds whole pages, and the stripes are filled round robin,
+        // so the pages in all of them add up to the end of the storage
+        int pages = 0;
+        for (size_t i = 0; i < m_fds.size(); i++)
+        {
+            long long size = _lseeki64(m_fds[i], 0, SEEK_END);
+            if (size > m_header.fileOffsetFirstPageStream0)
+            {
+                pages += (int)((size - m_header.fileOffsetFirstPageStream0) / m_header.pageSize);
+            }
+        }
+        if (m_pageAddressed)
+        {
+            m_fileEnd = firstPage() + pages;
+        }
+        else
+        {
+            m_fileEnd = m_header.fileOffsetFirstPageStream0 + pages * m_header.pageSize;
+        }
         loadStreams();
-        return SS_SUCCESS;
+        return loadCopyOnWrite();
+    }
+
+    int StructuredStorage::CreateStorage(const char *filename, int pageSize, int options)
+    {
+        return CreateStripedStorage(&filename, 1, pageSize, options);
+    }
+
+    int StructuredStorage::CreateStripedStorage(const char **filenames, int count, int pageSize, int options)
+    {
+        long long start = beginCall();
+        int r = createStripedStorage(filenames, count, pageSize, options);
+        endCall(start, TRACE_CREATE_STORAGE, r, count, pageSize, options);
+        return r;
     }
 
-    int StructuredStorage::CreateStorage(const char *filename, int pageSize)
+    int StructuredStorage::createStripedStorage(const char **filenames, int count, int pageSize, int options)
     {
         if (m_fd != -1)
         {
             return SS_ALREADY_OPENED;
         }
-        m_fd = _open(filename, O_RDWR | O_CREAT | O_TRUNC, _S_IREAD | _S_IWRITE);
-        if (m_fd < 0)
+        if (count < 1)
         {
             return SS_ERROR;
         }
+        if (options & SS_DIRECT_IO)
+        {
+            options |= SS_ALIGNED;
+        }
+        if ((options & SS_ALIGNED) && (pageSize % BLOCK_SIZE) != 0)
+        {
+            return SS_BAD_PAGESIZE;
+        }
+        int r = openFiles(filenames, count, O_RDWR | O_CREAT | O_TRUNC, (options & SS_DIRECT_IO) != 0);
+        if (r != SS_SUCCESS)
+        {
+            return r;
+        }
+        m_aligned = (options & SS_ALIGNED) != 0;
         m_header.magic = MAGIC_NUM;
-        m_header.version = VERSION_NUM;
+        m_header.pageSize = pageSize;
         m_header.fileOffsetFirstFreePage = 0;
-        m_header.fileOffsetFirstPageStream0 = sizeof(fileheader);
         m_header.numstreams = 0;
-        m_header.pageSize = pageSize;
+        m_header.flags = m_aligned ? HEADER_ALIGNED : 0;
+        m_header.stripes = count;
+        m_header.stripeIndex = 0;
+        // A single file keeps the older layouts unless it has to grow past
+        // 2 GB, so that it can still be opened by code that does not know about stripes
+        m_pageAddressed = count > 1 || (options & SS_LARGE) != 0;
+        if (m_pageAddressed)
+        {
+            m_header.version = VERSION_PAGE_ADDRESSED;
+        }
+        else if (m_aligned)
+        {
+            m_header.version = VERSION_ALIGNED;
+        }
+        else
+        {
+            m_header.version = VERSION_NUM;
+        }
+        if (m_aligned)
+        {
+            // Header gets a block of its own so that the first page is aligned
+            m_header.fileOffsetFirstPageStream0 = BLOCK_SIZE;
+            m_ioBuffer = (char *)_aligned_malloc(pageSize, BLOCK_SIZE);
+        }
+        else
+        {
+            m_header.fileOffsetFirstPageStream0 = headerSize();
+        }
+        m_fileEnd = firstPage();
         writeStorageHeader();
+        r = writeStripeHeaders();
+        if (r != SS_SUCCESS)
+        {
+            return r;
+        }
 
         m_pageDataSize = m_header.pageSize - sizeof(pageheader);
         int streamid;
-        int r = CreateStream("PaGiNgSyStEm", streamid);
+        r = createStream("PaGiNgSyStEm", streamid);
         TT_ASSERT(streamid == STREAM0);
         TT_ASSERT(r == SS_SUCCESS);
         return r;
@@ -142,6 +398,14 @@ namespace structuredstorage_ns
 
 
     int StructuredStorage::Write(int stream, const char *buf, int bytesToWrite)
+    {
+        long long start = beginCall();
+        int r = writeStream(stream, buf, bytesToWrite);
+        endCall(start, TRACE_WRITE, r, stream, bytesToWrite);
+        return r;
+    }
+
+    int StructuredStorage::writeStream(int stream, const char *buf, int bytesToWrite)
     {
         if (m_fd == -1)
         {
@@ -152,23 +416,45 @@ namespace structuredstorage_ns
         if (it == m_streams.end())
             return SS_INVALID_STREAM;
         Stream& strm = (*it).second;
+        if (bytesToWrite > INT_MAX - strm.currentStreamPos)
+        {
+            // Stream positions and sizes are int, see SS_LARGE
+            return SS_TOO_LARGE;
+        }
+        touchStream(strm);
+        if (strm.pageData == nullptr)
+        {
+            int r = loadStream(strm);
+            if (r != SS_SUCCESS)
+                return r;
+        }
         while (bytesToWrite)
         {
             // The number of bytes in this page that could be written
             int unwrittenBytesInPage = m_pageDataSize - strm.currentPagePos;
             if (unwrittenBytesInPage == 0)
             {
-                writeCurrentPage(strm);
-                if (loadNextPage(strm) == SS_NOPAGES)
+                if (strm.dirty)
+                {
+                    int r = writeCurrentPage(strm);
+                    if (r != SS_SUCCESS)
+                        return r;
+                }
+                int r = loadNextPage(strm);
+                if (r == SS_NOPAGES)
                 {
-                    allocNewPage(strm);
+                    r = allocNewPage(strm);
                 }
+                if (r != SS_SUCCESS)
+                    return r;
             }
             else
             {
                 // The number of bytes we want to write to this page
                 int bytesToWriteToPage = bytesToWrite < unwrittenBytesInPage ? bytesToWrite : unwrittenBytesInPage;
-                writeblock(strm, src, bytesToWriteToPage);
+                int r = writeblock(strm, src, bytesToWriteToPage);
+                if (r != SS_SUCCESS)
+                    return r;
                 bytesToWrite -= bytesToWriteToPage;
                 src += bytesToWriteToPage;
             }
@@ -177,6 +463,17 @@ namespace structuredstorage_ns
     }
 
     int StructuredStorage::FileSeek(int stream, const Position& pos)
+    {
+        long long start = beginCall();
+        int r = fileSeek(stream, pos);
+        if (m_trace)
+        {
+            endCall(start, TRACE_FILE_SEEK, r, stream, positionToken(pos, false));
+        }
+        return r;
+    }
+
+    int StructuredStorage::fileSeek(int stream, const Position& pos)
     {
         if (m_fd == -1)
         {
@@ -186,11 +483,27 @@ namespace structuredstorage_ns
         if (it == m_streams.end())
             return SS_INVALID_STREAM;
         Stream& strm = (*it).second;
+        touchStream(strm);
+        int offset = resolvePage(strm, pos.fileOffsetPage);
+        if (strm.pageData != nullptr && offset == strm.currentPage.fileOffsetThisPage)
+        {
+            // Already on that page
+            strm.currentPagePos = pos.offsetInPage;
+            strm.currentStreamPos = pos.streamOffset;
+            return SS_SUCCESS;
+        }
         if (strm.dirty)
         {
-            writeCurrentPage(strm);
+            int r = writeCurrentPage(strm);
+            if (r != SS_SUCCESS)
+                return r;
+        }
+        if (strm.pageData == nullptr)
+        {
+            // Not loaded or released, no need to read the page, we are about to replace it
+            strm.pageData = allocPageBuffer();
         }
-        int r = readPageHeader(pos.fileOffsetPage, strm.currentPage);
+        int r = readPageHeader(offset, strm.currentPage);
         if (r != SS_SUCCESS)
         {
             return r;
@@ -200,12 +513,25 @@ namespace structuredstorage_ns
         {
             return r;
         }
+        strm.currentLink = pos.fileOffsetPage;
         strm.currentPagePos = pos.offsetInPage;
         strm.currentStreamPos = pos.streamOffset;
+        strm.loaded = true;
         return SS_SUCCESS;
     }
 
     int StructuredStorage::FilePosition(int stream, Position& pos)
+    {
+        long long start = beginCall();
+        int r = filePosition(stream, pos);
+        if (m_trace)
+        {
+            endCall(start, TRACE_FILE_POSITION, r, stream, positionToken(pos, true));
+        }
+        return r;
+    }
+
+    int StructuredStorage::filePosition(int stream, Position& pos)
     {
         if (m_fd == -1)
         {
@@ -215,13 +541,28 @@ namespace structuredstorage_ns
         if (it == m_streams.end())
             return SS_INVALID_STREAM;
         Stream& strm = (*it).second;
-        pos.fileOffsetPage = strm.currentPage.fileOffsetThisPage;
+        pos.fileOffsetPage = strm.currentLink;
         pos.offsetInPage = strm.currentPagePos;
         pos.streamOffset = strm.currentStreamPos;
+        if (strm.currentPagePos == m_pageDataSize && strm.currentPage.fileOffsetNextPage != 0)
+        {
+            // At the very end of a full page. Give the start of the next page so
+            // that FileSeek() lands on the page the next Read or Write will use
+            pos.fileOffsetPage = strm.currentPage.fileOffsetNextPage;
+            pos.offsetInPage = 0;
+        }
         return SS_SUCCESS;
     }
 
     int StructuredStorage::StreamSeek(int stream, int offset)
+    {
+        long long start = beginCall();
+        int r = streamSeek(stream, offset);
+        endCall(start, TRACE_STREAM_SEEK, r, stream, offset);
+        return r;
+    }
+
+    int StructuredStorage::streamSeek(int stream, int offset)
     {
         if (m_fd == -1)
         {
@@ -231,39 +572,70 @@ namespace structuredstorage_ns
         if (it == m_streams.end())
             return SS_INVALID_STREAM;
         Stream& strm = (*it).second;
+        touchStream(strm);
         if (offset > strm.info.streamsize)
         {
             return SS_SEEK_RANGE;
         }
 
+        // The walk reads headers from disk, the current page's must be up to date
+        if (strm.dirty)
+        {
+            int r = writeCurrentPage(strm);
+            if (r != SS_SUCCESS)
+                return r;
+        }
+
         // Walk the chain of page headers until we get the offset we want.
         pageheader pgheader;
-        readPageHeader(strm.info.fileOffsetPage0, pgheader);
+        int link = strm.info.fileOffsetPage0;
+        int r = readPageHeader(resolvePage(strm, link), pgheader);
+        if (r != SS_SUCCESS)
+            return r;
         int streamOffsetOfPage = 0;
         while (true)
         {
             if (offset >= streamOffsetOfPage && offset <= (streamOffsetOfPage+pgheader.usedBytes))
             {
-                if (strm.dirty)
+                if (strm.pageData == nullptr)
                 {
-                    writeCurrentPage(strm);
+                    strm.pageData = allocPageBuffer();
                 }
                 strm.currentPage = pgheader;
-                readPageData(strm.currentPage, strm.pageData);
+                strm.currentLink = link;
+                r = readPageData(strm.currentPage, strm.pageData);
+                if (r != SS_SUCCESS)
+                    return r;
                 strm.currentStreamPos = offset;
                 strm.currentPagePos = offset - streamOffsetOfPage;
+                strm.loaded = true;
                 TT_ASSERT(strm.currentPagePos <= strm.currentPage.usedBytes);
                 return SS_SUCCESS;
             }
             streamOffsetOfPage += pgheader.usedBytes;
-            TT_ASSERT(pgheader.fileOffsetNextPage != 0);
-            readPageHeader(pgheader.fileOffsetNextPage, pgheader);
+            if (pgheader.fileOffsetNextPage == 0)
+            {
+                TT_ASSERT(false);
+                return SS_SEEK_RANGE;
+            }
+            link = pgheader.fileOffsetNextPage;
+            r = readPageHeader(resolvePage(strm, link), pgheader);
+            if (r != SS_SUCCESS)
+                return r;
         }
 
         return SS_SUCCESS;
     }
 
     int StructuredStorage::StreamPosition(int stream, int& pos)
+    {
+        long long start = beginCall();
+        int r = streamPosition(stream, pos);
+        endCall(start, TRACE_STREAM_POSITION, r, stream, pos);
+        return r;
+    }
+
+    int StructuredStorage::streamPosition(int stream, int& pos)
     {
         if (m_fd == -1)
         {
@@ -277,7 +649,28 @@ namespace structuredstorage_ns
         return SS_SUCCESS;
     }
 
+    int StructuredStorage::StreamSize(int stream, int& size)
+    {
+        if (m_fd == -1)
+        {
+            return SS_NOT_OPENED;
+        }
+        streammap_t::iterator it = m_streams.find(stream);
+        if (it == m_streams.end() || stream == STREAM0 || stream == m_cowStream)
+            return SS_INVALID_STREAM;
+        size = (*it).second.info.streamsize;
+        return SS_SUCCESS;
+    }
+
     int StructuredStorage::CreateStream(const char *name, int& streamid)
+    {
+        long long start = beginCall();
+        int r = createStream(name, streamid);
+        endCall(start, TRACE_CREATE_STREAM, r, r == SS_SUCCESS ? streamid : -1);
+        return r;
+    }
+
+    int StructuredStorage::createStream(const char *name, int& streamid)
     {
         if (m_fd == -1)
         {
@@ -295,20 +688,17 @@ namespace structuredstorage_ns
             ++it;
         }
         
-        long pos = _lseek(m_fd, 0, SEEK_END);
+        long pos = allocFileEnd();
         pageheader pgheader;
         pgheader.streamid = m_streams.size();
         pgheader.usedBytes = 0;
         pgheader.fileOffsetThisPage = pos;
         pgheader.fileOffsetNextPage = 0;
 
-        writePageHeader(pgheader);
-        _lseek(m_fd, m_pageDataSize-1, SEEK_CUR);
-        int c = 0;
-        _write(m_fd, &c, 1);    // Extend the file
-        
+        writeNewPage(pgheader);
+
         Stream strm;
-        strm.pageData = new char[m_header.pageSize - sizeof(pageheader)];
+        strm.pageData = allocPageBuffer();
         strm.currentPage = pgheader;
         strm.info.streamid = m_streams.size();
         strm.info.fileOffsetPage0 =  pgheader.fileOffsetThisPage;
@@ -317,6 +707,10 @@ namespace structuredstorage_ns
         strm.currentStreamPos = 0;
         strm.currentPagePos = 0;
         strm.dirty = false;
+        strm.loaded = true;
+        strm.lastAccess = nowMilliseconds();
+        strm.tag = strm.info.streamid;
+        strm.currentLink = pgheader.fileOffsetThisPage;
 
         m_streams.insert(streammap_t::value_type(strm.info.streamid, strm));
 
@@ -329,7 +723,88 @@ namespace structuredstorage_ns
         return SS_SUCCESS ;
     }
 
+    int StructuredStorage::CloneStream(int stream, const char *name, int& newStreamid)
+    {
+        long long start = beginCall();
+        int r = cloneStream(stream, name, newStreamid);
+        endCall(start, TRACE_CLONE_STREAM, r, stream, r == SS_SUCCESS ? newStreamid : -1);
+        return r;
+    }
+
+    // Both streams get a new owner tag, which makes every existing page foreign
+    // to both of them. A page is copied by copyOnWrite() when a stream first writes
+    // to it, so the clone costs the same however large the stream is
+    int StructuredStorage::cloneStream(int stream, const char *name, int& newStreamid)
+    {
+        if (m_fd == -1)
+        {
+            return SS_NOT_OPENED;
+        }
+        streammap_t::iterator it = m_streams.find(stream);
+        if (it == m_streams.end() || stream == STREAM0 || stream == m_cowStream)
+            return SS_INVALID_STREAM;
+        int streamid;
+        if (openStream(name, streamid) == SS_SUCCESS)
+        {
+            return SS_EXISTS;
+        }
+        Stream& src = (*it).second;
+        if (src.dirty)
+        {
+            int r = writeCurrentPage(src);
+            if (r != SS_SUCCESS)
+                return r;
+        }
+
+        Stream strm;
+        strm.info = src.info;
+        strm.info.streamid = m_streams.size();
+        strcpy_s(strm.info.name, sizeof(strm.info.name), name);
+        memset(&strm.currentPage, 0, sizeof(pageheader));
+        strm.currentPage.fileOffsetThisPage = strm.info.fileOffsetPage0;
+        strm.pageData = nullptr;
+        strm.currentStreamPos = 0;
+        strm.currentPagePos = 0;
+        strm.dirty = false;
+        strm.loaded = false;
+        strm.lastAccess = 0;
+        strm.tag = m_nextTag++;
+        strm.remap = src.remap;     // Shared, see copyOnWrite()
+        strm.currentLink = strm.info.fileOffsetPage0;
+        src.tag = m_nextTag++;
+        m_cowDirty = true;
+
+        m_streams.insert(streammap_t::value_type(strm.info.streamid, strm));
+
+        flushStreamDirectory();
+
+        newStreamid = strm.info.streamid;
+
+        ++m_header.numstreams;
+        writeStorageHeader();
+        return SS_SUCCESS;
+    }
+
     int StructuredStorage::OpenStream(const char *name, int& streamid)
+    {
+        long long start = beginCall();
+        int r = openStream(name, streamid);
+        if (m_trace)
+        {
+            // The stream may have been written before the trace was started
+            int size = 0;
+            int pos = 0;
+            if (r == SS_SUCCESS)
+            {
+                StreamSize(streamid, size);
+                streamPosition(streamid, pos);
+            }
+            endCall(start, TRACE_OPEN_STREAM, r, r == SS_SUCCESS ? streamid : -1, size, pos);
+        }
+        return r;
+    }
+
+    int StructuredStorage::openStream(const char *name, int& streamid)
     {
         if (m_fd == -1)
         {
@@ -353,19 +828,25 @@ namespace structuredstorage_ns
 /****************************************************************************
 * Internal implementaion methods
 */
-    // Load all the streamInfo's from stream 0, create a Stream and insert into map
+    // Load all the streamInfo's from stream 0, create a Stream and insert into map.
+    // Only the directory is read here, page buffers and first pages are left to
+    // loadStream() on the first access of each stream
     int StructuredStorage::loadStreams()
     {
         TT_ASSERT(m_streams.size() == 0);
 
         // have to manually load stream0 so Read() will work
         Stream strm;
-        strm.pageData = new char[m_header.pageSize - sizeof(pageheader)];
-        readPageHeader(m_header.fileOffsetFirstPageStream0, strm.currentPage);
+        strm.pageData = allocPageBuffer();
+        readPageHeader(firstPage(), strm.currentPage);
         readPageData(strm.currentPage, strm.pageData);
         strm.currentStreamPos = 0;
         strm.currentPagePos = 0;
         strm.dirty = false;
+        strm.loaded = true;
+        strm.lastAccess = nowMilliseconds();
+        strm.tag = STREAM0;
+        strm.currentLink = firstPage();
         m_streams.insert(streammap_t::value_type(STREAM0, strm));
 
         int nread;
@@ -373,7 +854,7 @@ namespace structuredstorage_ns
         {
             Stream strm;
 
-            int r = Read(STREAM0, (char *)&strm.info, sizeof(streamInfo), nread);
+            int r = readStream(STREAM0, (char *)&strm.info, sizeof(streamInfo), nread);
             TT_ASSERT(r == SS_SUCCESS);
             TT_ASSERT(nread == sizeof(streamInfo));
             // STREAM0 is a little wierd. I have to mostly manually create it above, but
@@ -385,58 +866,414 @@ namespace structuredstorage_ns
             }
             else
             {
-                r = readPageHeader(strm.info.fileOffsetPage0, strm.currentPage);
-                if (r != SS_SUCCESS)
-                {
-                    return r;
-                }
-                strm.pageData = new char[m_header.pageSize - sizeof(pageheader)];
-                r = readPageData(strm.currentPage, strm.pageData);
-                if (r != SS_SUCCESS)
-                {
-                    return r;
-                }
+                // Enough of the current page for FilePosition() to work unloaded
+                memset(&strm.currentPage, 0, sizeof(pageheader));
+                strm.currentPage.streamid = strm.info.streamid;
+                strm.currentPage.fileOffsetThisPage = strm.info.fileOffsetPage0;
+                strm.pageData = nullptr;
                 strm.currentStreamPos = 0;
                 strm.currentPagePos = 0;
                 strm.dirty = false;
+                strm.loaded = false;
+                strm.lastAccess = 0;
+                strm.tag = strm.info.streamid;
+                strm.currentLink = strm.info.fileOffsetPage0;
                 m_streams.insert(streammap_t::value_type(strm.info.streamid, strm));
             }
         }
         return SS_SUCCESS;
     }
 
-    // Read the storage header
-    int StructuredStorage::readStorageHeader()
+    // Give a stream without a page buffer its buffer back. A stream that has not been
+    // accessed since OpenStorage reads its first page, one that had its buffer
+    // released for being idle re-reads the page it was on
+    int StructuredStorage::loadStream(Stream& strm)
     {
-        TT_ASSERT(m_fd > 0);
-        _lseek(m_fd, 0, SEEK_SET);
-        int r = _read(m_fd, &m_header, sizeof(m_header));
-        if (r < 0)
+        TT_ASSERT(strm.pageData == nullptr);
+        strm.pageData = allocPageBuffer();
+        int r;
+        if (!strm.loaded)
         {
-            TT_ASSERT(false);
-            return SS_ERROR;
+            r = readPageHeader(resolvePage(strm, strm.info.fileOffsetPage0), strm.currentPage);
+            if (r != SS_SUCCESS)
+            {
+                return r;
+            }
+            strm.currentLink = strm.info.fileOffsetPage0;
+            strm.currentStreamPos = 0;
+            strm.currentPagePos = 0;
         }
-        if (r != sizeof(fileheader))
+        r = readPageData(strm.currentPage, strm.pageData);
+        if (r != SS_SUCCESS)
         {
-            TT_ASSERT(false);
-            return SS_ERROR;
+            return r;
+        }
+        strm.loaded = true;
+        return SS_SUCCESS;
+    }
+
+    // Note an access to the stream, and every so often look for idle streams
+    void StructuredStorage::touchStream(Stream& strm)
+    {
+        if (m_idleRelease == 0)
+            return;
+        long long now = nowMilliseconds();
+        strm.lastAccess = now;
+        if (now - m_lastIdleScan >= m_idleRelease)
+        {
+            releaseIdleBuffers();
+        }
+    }
+
+    // Write the stream's page if it is dirty, and return its buffer to the pool
+    int StructuredStorage::releaseStreamBuffer(Stream& strm)
+    {
+        if (strm.pageData == nullptr)
+            return SS_SUCCESS;
+        if (strm.dirty)
+        {
+            int r = writeCurrentPage(strm);
+            if (r != SS_SUCCESS)
+                return r;
+        }
+        freePageBuffer(strm.pageData);
+        strm.pageData = nullptr;
+        return SS_SUCCESS;
+    }
+
+    void StructuredStorage::SetIdleRelease(int milliseconds)
+    {
+        long long start = beginCall();
+        m_idleRelease = milliseconds;
+        endCall(start, TRACE_SET_IDLE_RELEASE, SS_SUCCESS, 0, milliseconds);
+    }
+
+    int StructuredStorage::ReleaseIdleBuffers()
+    {
+        long long start = beginCall();
+        int r = releaseIdleBuffers();
+        endCall(start, TRACE_RELEASE_IDLE_BUFFERS, r, 0);
+        return r;
+    }
+
+    int StructuredStorage::releaseIdleBuffers()
+    {
+        if (m_fd == -1)
+        {
+            return SS_NOT_OPENED;
+        }
+        if (m_idleRelease == 0)
+        {
+            return SS_SUCCESS;
+        }
+        long long now = nowMilliseconds();
+        m_lastIdleScan = now;
+        streammap_t::iterator it = m_streams.begin();
+        streammap_t::iterator eit = m_streams.end();
+        while (it != eit)
+        {
+            Stream& strm = (*it).second;
+            if (strm.pageData && now - strm.lastAccess >= m_idleRelease)
+            {
+                int r = releaseStreamBuffer(strm);
+                if (r != SS_SUCCESS)
+                    return r;
+            }
+            ++it;
+        }
+        return SS_SUCCESS;
+    }
+
+    int StructuredStorage::SetWriteBack(int maxDirtyPages)
+    {
+        long long start = beginCall();
+        int r = setWriteBack(maxDirtyPages);
+        endCall(start, TRACE_SET_WRITE_BACK, r, 0, maxDirtyPages);
+        return r;
+    }
+
+    int StructuredStorage::setWriteBack(int maxDirtyPages)
+    {
+        if (m_fd == -1)
+        {
+            return SS_NOT_OPENED;
+        }
+        int r = stopWriteBack();
+        if (r != SS_SUCCESS || maxDirtyPages <= 0)
+        {
+            return r;
+        }
+        m_writeBackLimit = maxDirtyPages;
+        m_flushBuffer = (char *)_aligned_malloc(m_fds.size() * COALESCE_PAGES * m_header.pageSize, BLOCK_SIZE);
+        m_flushStop = false;
+        m_flushRequested = false;
+        m_writeBack = true;
+        if (m_fds.size() > 1)
+        {
+            m_writerStop = false;
+            m_stripeWriters.resize(m_fds.size());
+            for (size_t i = 0; i < m_stripeWriters.size(); i++)
+            {
+                m_stripeWriters[i].busy = false;
+                m_stripeWriters[i].result = SS_SUCCESS;
+                m_stripeWriters[i].thread = thread(&StructuredStorage::writerThread, this, (int)i);
+            }
+        }
+        m_flusher = thread(&StructuredStorage::flushThread, this);
+        return SS_SUCCESS;
+    }
+
+    int StructuredStorage::FlushWriteBack()
+    {
+        long long start = beginCall();
+        int r = flushWriteBack();
+        endCall(start, TRACE_FLUSH_WRITE_BACK, r, 0);
+        return r;
+    }
+
+    int StructuredStorage::flushWriteBack()
+    {
+        if (m_fd == -1)
+        {
+            return SS_NOT_OPENED;
+        }
+        if (!m_writeBack)
+        {
+            return SS_SUCCESS;
+        }
+        unique_lock<mutex> lock(m_cacheMutex);
+        m_flushRequested = true;
+        m_flushWake.notify_one();
+        while (m_writeBackError == SS_SUCCESS && (!m_dirtyPages.empty() || !m_flushingPages.empty()))
+        {
+            m_flushDone.wait(lock);
+        }
+        return m_writeBackError;
+    }
+
+    // Get a page buffer from the pool, growing the pool by a slab if it is empty.
+    // Buffers hold the page data and are aligned for SIMD copies. In the aligned
+    // layout they are whole block aligned pages instead, the data following room
+    // for the header, so that readPageData() and writePageData() work in place
+    char *StructuredStorage::allocPageBuffer()
+    {
+        if (m_freeBuffers.empty())
+        {
+            int align = m_aligned ? BLOCK_SIZE : BUFFER_ALIGN;
+            int bufferSize = m_aligned ? m_header.pageSize : (m_pageDataSize + align - 1) / align * align;
+            int dataOffset = m_aligned ? sizeof(pageheader) : 0;
+            char *slab = (char *)_aligned_malloc(bufferSize * BUFFERS_PER_SLAB, align);
+            TT_ASSERT(slab != nullptr);
+            m_slabs.push_back(slab);
+            // Hand them out lowest address first
+            for (int i = BUFFERS_PER_SLAB - 1; i >= 0; i--)
+            {
+                m_freeBuffers.push_back(slab + i * bufferSize + dataOffset);
+            }
+        }
+        char *buf = m_freeBuffers.back();
+        m_freeBuffers.pop_back();
+        return buf;
+    }
+
+    void StructuredStorage::freePageBuffer(char *buf)
+    {
+        m_freeBuffers.push_back(buf);
+    }
+
+    // Release the whole pool, all streams must have given up their buffers
+    void StructuredStorage::freePagePool()
+    {
+        for (size_t i = 0; i < m_slabs.size(); i++)
+        {
+            _aligned_free(m_slabs[i]);
+        }
+        m_slabs.clear();
+        m_freeBuffers.clear();
+    }
+
+    // Read the storage header
+    int StructuredStorage::readStorageHeader()
+    {
+        TT_ASSERT(m_fd > 0);
+        TT_ASSERT(m_ioBuffer == nullptr);
+        _lseek(m_fd, 0, SEEK_SET);
+        int r = _read(m_fd, &m_header, sizeof(m_header));
+        if (r < 0)
+        {
+            TT_ASSERT(false);
+            return SS_ERROR;
+        }
+        if (r < headerSize())
+        {
+            TT_ASSERT(false);
+            return SS_ERROR;
+        }
+        if (m_header.version < VERSION_PAGE_ADDRESSED)
+        {
+            // What was read past the older header is page data
+            m_header.flags = m_header.version == VERSION_ALIGNED ? HEADER_ALIGNED : 0;
+            m_header.stripes = 1;
+            m_header.stripeIndex = 0;
         }
 
         return SS_SUCCESS;
     }
 
+    // Size of the header on disk, the older versions have no stripes
+    int StructuredStorage::headerSize() const
+    {
+        if (m_header.version >= VERSION_PAGE_ADDRESSED)
+            return sizeof(fileheader);
+        return offsetof(fileheader, flags);
+    }
+
+    // Write a copy of the header to each stripe other than the first, which
+    // identifies the file as that stripe on open. The copies are not kept up to date
+    int StructuredStorage::writeStripeHeaders()
+    {
+        for (size_t i = 1; i < m_fds.size(); i++)
+        {
+            fileheader copy = m_header;
+            copy.stripeIndex = (int)i;
+            int r;
+            _lseek(m_fds[i], 0, SEEK_SET);
+            if (m_aligned)
+            {
+                memset(m_ioBuffer, 0, BLOCK_SIZE);
+                memcpy(m_ioBuffer, &copy, sizeof(copy));
+                r = _write(m_fds[i], m_ioBuffer, BLOCK_SIZE) == BLOCK_SIZE ? SS_SUCCESS : SS_ERROR;
+            }
+            else
+            {
+                r = _write(m_fds[i], &copy, sizeof(copy)) == sizeof(copy) ? SS_SUCCESS : SS_ERROR;
+            }
+            if (r != SS_SUCCESS)
+            {
+                TT_ASSERT(false);
+                return r;
+            }
+        }
+        return SS_SUCCESS;
+    }
+
+    // Open the stripes, m_fd is the first
+    int StructuredStorage::openFiles(const char **filenames, int count, int flags, bool direct)
+    {
+        TT_ASSERT(m_fds.empty());
+        for (int i = 0; i < count; i++)
+        {
+            int fd = openFile(filenames[i], flags, direct);
+            if (fd < 0)
+            {
+                closeFiles();
+                return SS_ERROR;
+            }
+            m_fds.push_back(fd);
+            m_fileMutexes.push_back(unique_ptr<mutex>(new mutex));
+        }
+        m_fd = m_fds[0];
+        return SS_SUCCESS;
+    }
+
+    void StructuredStorage::closeFiles()
+    {
+        for (size_t i = 0; i < m_fds.size(); i++)
+        {
+            _close(m_fds[i]);
+        }
+        m_fds.clear();
+        m_fileMutexes.clear();
+        m_fd = -1;
+    }
+
+    // Storage offset of the first page, which is the first page of stream 0
+    int StructuredStorage::firstPage() const
+    {
+        return m_pageAddressed ? 1 : m_header.fileOffsetFirstPageStream0;
+    }
+
+    // Map a storage offset of a page, and an offset in that page, to the stripe
+    // holding it and the position in its file. Pages are dealt round robin to the
+    // stripes. Every stripe starts with the same header area, so pages are at the
+    // same alignment in all of them
+    long long StructuredStorage::mapOffset(int offset, int offsetInPage, int& stripe) const
+    {
+        if (!m_pageAddressed)
+        {
+            // Older layouts are a single file addressed by byte offset
+            stripe = 0;
+            return (long long)offset + offsetInPage;
+        }
+        int stripes = m_fds.size();
+        int page = offset - firstPage();
+        stripe = page % stripes;
+        return m_header.fileOffsetFirstPageStream0 + (long long)(page / stripes) * m_header.pageSize + offsetInPage;
+    }
+
+    // Read or write at a position in one of the files. The flusher thread shares
+    // the files, a seek and its transfer must not be split. Each file has its
+    // own lock, so transfers to different stripes do not wait for each other
+    int StructuredStorage::readFile(int stripe, long long pos, void *buf, int size)
+    {
+        lock_guard<mutex> lock(*m_fileMutexes[stripe]);
+        _lseeki64(m_fds[stripe], pos, SEEK_SET);
+        return _read(m_fds[stripe], buf, size);
+    }
+
+    int StructuredStorage::writeFile(int stripe, long long pos, const void *buf, int size)
+    {
+        lock_guard<mutex> lock(*m_fileMutexes[stripe]);
+        _lseeki64(m_fds[stripe], pos, SEEK_SET);
+        return _write(m_fds[stripe], buf, size);
+    }
+
+    // Read or write in the page at a storage offset, returns what _read()/_write() do
+    int StructuredStorage::readAt(int offset, int offsetInPage, void *buf, int size)
+    {
+        int stripe;
+        long long pos = mapOffset(offset, offsetInPage, stripe);
+        return readFile(stripe, pos, buf, size);
+    }
+
+    int StructuredStorage::writeAt(int offset, int offsetInPage, const void *buf, int size)
+    {
+        int stripe;
+        long long pos = mapOffset(offset, offsetInPage, stripe);
+        return writeFile(stripe, pos, buf, size);
+    }
+
+    // Storage offset for a new page at the end of the storage. The caller
+    // writes the page, which extends the file of its stripe
+    int StructuredStorage::allocFileEnd()
+    {
+        int pos = m_fileEnd;
+        m_fileEnd += m_pageAddressed ? 1 : m_header.pageSize;
+        return pos;
+    }
+
     // Write the storage header
     int StructuredStorage::writeStorageHeader()
     {
         TT_ASSERT(m_fd > 0);
-        _lseek(m_fd, 0, SEEK_SET);
-        int r = _write(m_fd, &m_header, sizeof(m_header));
+        if (m_aligned)
+        {
+            memset(m_ioBuffer, 0, BLOCK_SIZE);
+            memcpy(m_ioBuffer, &m_header, sizeof(m_header));
+            if (writeFile(0, 0, m_ioBuffer, BLOCK_SIZE) != BLOCK_SIZE)
+            {
+                TT_ASSERT(false);
+                return SS_ERROR;
+            }
+            return SS_SUCCESS;
+        }
+        int r = writeFile(0, 0, &m_header, headerSize());
         if (r < 0)
         {
             TT_ASSERT(false);
             return SS_ERROR;
         }
-        if (r != sizeof(fileheader))
+        if (r != headerSize())
         {
             TT_ASSERT(false);
             return SS_ERROR;
@@ -448,8 +1285,19 @@ namespace structuredstorage_ns
     int StructuredStorage::readPageHeader(int offset, pageheader& pheader)
     {
         TT_ASSERT(m_fd > 0);
-        _lseek(m_fd, offset, SEEK_SET);
-        int r = _read(m_fd, &pheader, sizeof(pageheader));
+        if (m_writeBack && cachedHeader(offset, pheader))
+        {
+            return SS_SUCCESS;
+        }
+        if (m_aligned)
+        {
+            int r = readAligned(offset, BLOCK_SIZE, m_ioBuffer);
+            if (r != SS_SUCCESS)
+                return r;
+            memcpy(&pheader, m_ioBuffer, sizeof(pageheader));
+            return SS_SUCCESS;
+        }
+        int r = readAt(offset, 0, &pheader, sizeof(pageheader));
         if (r < 0)
         {
             TT_ASSERT(false);
@@ -464,11 +1312,24 @@ namespace structuredstorage_ns
     }
 
     // Write a page header
+    // For the aligned layout this is a read-modify-write of the first block
+    // of the page, prefer writePageData() which writes the header with the data
     int StructuredStorage::writePageHeader(pageheader& pheader)
     {
         TT_ASSERT(m_fd > 0);
-        _lseek(m_fd, pheader.fileOffsetThisPage, SEEK_SET);
-        int r = _write(m_fd, &pheader, sizeof(pageheader));
+        if (m_writeBack)
+        {
+            return cachePage(pheader.fileOffsetThisPage, &pheader, nullptr);
+        }
+        if (m_aligned)
+        {
+            int r = readAligned(pheader.fileOffsetThisPage, BLOCK_SIZE, m_ioBuffer);
+            if (r != SS_SUCCESS)
+                return r;
+            memcpy(m_ioBuffer, &pheader, sizeof(pageheader));
+            return writeAligned(pheader.fileOffsetThisPage, BLOCK_SIZE, m_ioBuffer);
+        }
+        int r = writeAt(pheader.fileOffsetThisPage, 0, &pheader, sizeof(pageheader));
         if (r < 0)
         {
             TT_ASSERT(false);
@@ -483,12 +1344,20 @@ namespace structuredstorage_ns
     }
 
     // Read the page data for the given header
-    // buf MUST point to a buffer of size PAGE_DATA_SIZE
+    // buf MUST be a buffer from allocPageBuffer()
     int StructuredStorage::readPageData(pageheader& pheader, char *buf)
     {
         TT_ASSERT(m_fd > 0);
-        _lseek(m_fd, pheader.fileOffsetThisPage+sizeof(pageheader), SEEK_SET);
-        int r = _read(m_fd, buf, m_pageDataSize);
+        if (m_writeBack && cachedData(pheader.fileOffsetThisPage, buf))
+        {
+            return SS_SUCCESS;
+        }
+        if (m_aligned)
+        {
+            // Read the whole page into the buffer, the header lands in front of the data
+            return readAligned(pheader.fileOffsetThisPage, m_header.pageSize, buf - sizeof(pageheader));
+        }
+        int r = readAt(pheader.fileOffsetThisPage, sizeof(pageheader), buf, m_pageDataSize);
         if (r < 0)
         {
             TT_ASSERT(false);
@@ -503,13 +1372,21 @@ namespace structuredstorage_ns
     }
 
     // Write the page data for the given header
-    // buf MUST point to a buffer of size PAGE_DATA_SIZE
-    int StructuredStorage::writePageData(pageheader& pheader, const char *buf)
+    // buf MUST be a buffer from allocPageBuffer()
+    // For the aligned layout the header is written too, as part of the same page write
+    int StructuredStorage::writePageData(pageheader& pheader, char *buf)
     {
         TT_ASSERT(m_fd > 0);
-        long ll = _lseek(m_fd, pheader.fileOffsetThisPage+sizeof(pageheader), SEEK_SET);
-        cout << ll;
-        int r = _write(m_fd, buf, m_pageDataSize);
+        if (m_writeBack)
+        {
+            return cachePage(pheader.fileOffsetThisPage, m_aligned ? &pheader : nullptr, buf);
+        }
+        if (m_aligned)
+        {
+            memcpy(buf - sizeof(pageheader), &pheader, sizeof(pageheader));
+            return writeAligned(pheader.fileOffsetThisPage, m_header.pageSize, buf - sizeof(pageheader));
+        }
+        int r = writeAt(pheader.fileOffsetThisPage, sizeof(pageheader), buf, m_pageDataSize);
         if (r < 0)
         {
             TT_ASSERT(false);
@@ -537,11 +1414,13 @@ namespace structuredstorage_ns
                 return r;
             }
         }
-        int r = readPageHeader(strm.currentPage.fileOffsetNextPage, strm.currentPage);
+        int link = strm.currentPage.fileOffsetNextPage;
+        int r = readPageHeader(resolvePage(strm, link), strm.currentPage);
         if (r != SS_SUCCESS)
         {
             return r;
         }
+        strm.currentLink = link;
 
         r = readPageData(strm.currentPage, strm.pageData);
         if (r != SS_SUCCESS)
@@ -552,15 +1431,84 @@ namespace structuredstorage_ns
         return SS_SUCCESS;
     }
 
+    // Write the header of a page that was just allocated at the end of the file,
+    // and extend the file to cover its data
+    int StructuredStorage::writeNewPage(pageheader& pheader)
+    {
+        TT_ASSERT(m_fd > 0);
+        if (m_writeBack)
+        {
+            return cachePage(pheader.fileOffsetThisPage, &pheader, nullptr, true);
+        }
+        if (m_aligned)
+        {
+            memset(m_ioBuffer, 0, m_header.pageSize);
+            memcpy(m_ioBuffer, &pheader, sizeof(pageheader));
+            return writeAligned(pheader.fileOffsetThisPage, m_header.pageSize, m_ioBuffer);
+        }
+        int r = writePageHeader(pheader);
+        if (r != SS_SUCCESS)
+            return r;
+        int c = 0;
+        if (writeAt(pheader.fileOffsetThisPage, m_header.pageSize - 1, &c, 1) != 1)    // Extend the file
+        {
+            TT_ASSERT(false);
+            return SS_ERROR;
+        }
+        return SS_SUCCESS;
+    }
+
+    // Read size bytes from the start of the page at offset into buf. Pages are
+    // block aligned in this layout, size and buf must be too
+    int StructuredStorage::readAligned(int offset, int size, char *buf)
+    {
+        TT_ASSERT(m_aligned);
+        TT_ASSERT((size % BLOCK_SIZE) == 0);
+        TT_ASSERT(((size_t)buf % BLOCK_SIZE) == 0);
+        int r = readAt(offset, 0, buf, size);
+        if (r != size)
+        {
+            TT_ASSERT(false);
+            return SS_ERROR;
+        }
+        return SS_SUCCESS;
+    }
+
+    // Write size bytes from buf to the start of the page at offset. Pages are
+    // block aligned in this layout, size and buf must be too
+    int StructuredStorage::writeAligned(int offset, int size, const char *buf)
+    {
+        TT_ASSERT(m_aligned);
+        TT_ASSERT((size % BLOCK_SIZE) == 0);
+        TT_ASSERT(((size_t)buf % BLOCK_SIZE) == 0);
+        int r = writeAt(offset, 0, buf, size);
+        if (r != size)
+        {
+            TT_ASSERT(false);
+            return SS_ERROR;
+        }
+        return SS_SUCCESS;
+    }
+
+    // Write a page header and its data
+    int StructuredStorage::writePage(pageheader& pheader, char *buf)
+    {
+        if (!m_aligned)
+        {
+            // The aligned layout writes the header along with the data
+            int r = writePageHeader(pheader);
+            if (r != SS_SUCCESS)
+                return r;
+        }
+        return writePageData(pheader, buf);
+    }
+
     // Write the current pageheader and data for the given stream
     int StructuredStorage::writeCurrentPage(Stream& strm)
     {
         TT_ASSERT(strm.currentPage.fileOffsetThisPage != 0);
-        int r = writePageHeader(strm.currentPage);
-        if (r != SS_SUCCESS)
-            return r;
-        
-        r = writePageData(strm.currentPage, strm.pageData);
+        TT_ASSERT(strm.currentPage.streamid == strm.tag);
+        int r = writePage(strm.currentPage, strm.pageData);
         if (r != SS_SUCCESS)
             return r;
         strm.dirty = false;
@@ -582,7 +1530,13 @@ namespace structuredstorage_ns
     // within a single page. This is a helper function for Write()
     int StructuredStorage::writeblock(Stream& strm, const char *buf, int bytesToWrite)
     {
-        TT_ASSERT((strm.currentPagePos + bytesToWrite) < m_pageDataSize);
+        TT_ASSERT((strm.currentPagePos + bytesToWrite) <= m_pageDataSize);
+        if (strm.currentPage.streamid != strm.tag)
+        {
+            int r = copyOnWrite(strm);
+            if (r != SS_SUCCESS)
+                return r;
+        }
         memcpy(&strm.pageData[strm.currentPagePos], buf, bytesToWrite);
         strm.currentPagePos += bytesToWrite;
         if (strm.currentPagePos > strm.currentPage.usedBytes)
@@ -616,7 +1570,7 @@ namespace structuredstorage_ns
             return r;
 
         pgheader.usedBytes = 0;
-        pgheader.streamid = strm.info.streamid;
+        pgheader.streamid = strm.tag;
         pgheader.fileOffsetNextPage = 0;
         r = writePageHeader(pgheader);
         if (r != SS_SUCCESS)
@@ -634,13 +1588,13 @@ namespace structuredstorage_ns
     {
         TT_ASSERT(m_header.fileOffsetFirstFreePage == 0);
         TT_ASSERT(strm.currentPage.fileOffsetNextPage == 0);
-        long pos = _lseek(m_fd, 0, SEEK_END);
+        long pos = allocFileEnd();
         pageheader newpage;
-        newpage.streamid = strm.currentPage.streamid;
+        newpage.streamid = strm.tag;
         newpage.usedBytes = 0;
         newpage.fileOffsetNextPage = 0;
         newpage.fileOffsetThisPage = pos;
-        int r = writePageHeader(newpage);
+        int r = writeNewPage(newpage);
         if (r != SS_SUCCESS)
         {
             return r;
@@ -653,10 +1607,6 @@ namespace structuredstorage_ns
             return r;
         }
 
-        _lseek(m_fd, m_pageDataSize-1, SEEK_CUR);
-        int c = 0;
-        _write(m_fd, &c, 1);    // Extend the file
-
         return SS_SUCCESS;
     }
 
@@ -665,6 +1615,13 @@ namespace structuredstorage_ns
     int StructuredStorage::allocNewPage(Stream& strm)
     {
         int r;
+        if (strm.currentPage.streamid != strm.tag)
+        {
+            // Linking the new page writes the current page
+            r = copyOnWrite(strm);
+            if (r != SS_SUCCESS)
+                return r;
+        }
         if (m_header.fileOffsetFirstFreePage != 0)
         {
             r = allocNewPageFromFreeList(strm);
@@ -686,17 +1643,543 @@ namespace structuredstorage_ns
         return SS_SUCCESS;
     }
 
+    // Get a page for copyOnWrite(), from the free list or the end of the storage.
+    // The caller writes the whole page, which extends the file
+    int StructuredStorage::allocPage(pageheader& pheader)
+    {
+        if (m_header.fileOffsetFirstFreePage != 0)
+        {
+            int r = readPageHeader(m_header.fileOffsetFirstFreePage, pheader);
+            if (r != SS_SUCCESS)
+                return r;
+            m_header.fileOffsetFirstFreePage = pheader.fileOffsetNextPage;
+            return writeStorageHeader();
+        }
+        pheader.fileOffsetThisPage = allocFileEnd();
+        return SS_SUCCESS;
+    }
+
+    // The stream is about to write its current page, which it shares with a clone.
+    // Give it its own copy of the page, and remember that the stream reads the
+    // copy wherever the shared page is linked. The shared page is left as it is
+    int StructuredStorage::copyOnWrite(Stream& strm)
+    {
+        TT_ASSERT(strm.currentPage.streamid != strm.tag);
+        TT_ASSERT(!strm.dirty);
+        pageheader copy;
+        int r = allocPage(copy);
+        if (r != SS_SUCCESS)
+            return r;
+        copy.streamid = strm.tag;
+        copy.usedBytes = strm.currentPage.usedBytes;
+        copy.fileOffsetNextPage = strm.currentPage.fileOffsetNextPage;
+        r = writePage(copy, strm.pageData);
+        if (r != SS_SUCCESS)
+            return r;
+
+        // Key the remap by the link the page was reached by. For a page that is
+        // itself a copy this replaces the entry of the earlier copy, so a stream
+        // never has more remaps than pages
+        if (!strm.remap)
+        {
+            strm.remap = std::make_shared<remap_t>();
+        }
+        else if (strm.remap.use_count() > 1)
+        {
+            // Still shared with a clone, which keeps the table as it is
+            strm.remap = std::make_shared<remap_t>(*strm.remap);
+        }
+        (*strm.remap)[strm.currentLink] = copy.fileOffsetThisPage;
+        strm.currentPage = copy;
+        m_cowDirty = true;
+        return SS_SUCCESS;
+    }
+
+    // The page the stream reads for a page offset found in a link or a Position
+    int StructuredStorage::resolvePage(const Stream& strm, int offset) const
+    {
+        if (!strm.remap)
+            return offset;
+        remap_t::const_iterator it = strm.remap->find(offset);
+        if (it == strm.remap->end())
+            return offset;
+        return (*it).second;
+    }
+
+    // Clone tags and remaps live in a stream of their own. A remap table shared
+    // by several streams is stored once:
+    //   int nextTag, int tables, tables times
+    //   int remaps, remaps times (int shared, int copy)
+    //   then int count, count times
+    //   int streamid, int tag, int table (-1 for none)
+    int StructuredStorage::loadCopyOnWrite()
+    {
+        if (openStream("CoPyOnWrItE", m_cowStream) != SS_SUCCESS)
+        {
+            m_cowStream = -1;
+            return SS_SUCCESS;
+        }
+        int nread;
+        int count;
+        int r = readStream(m_cowStream, (char *)&m_nextTag, sizeof(int), nread);
+        if (r != SS_SUCCESS)
+            return r;
+        r = readStream(m_cowStream, (char *)&count, sizeof(int), nread);
+        if (r != SS_SUCCESS)
+            return r;
+        std::vector<std::shared_ptr<remap_t> > tables;
+        for (int i = 0; i < count; i++)
+        {
+            int remaps;
+            r = readStream(m_cowStream, (char *)&remaps, sizeof(int), nread);
+            if (r != SS_SUCCESS)
+                return r;
+            std::shared_ptr<remap_t> table = std::make_shared<remap_t>();
+            for (int j = 0; j < remaps; j++)
+            {
+                int remap[2];
+                r = readStream(m_cowStream, (char *)remap, sizeof(remap), nread);
+                if (r != SS_SUCCESS)
+                    return r;
+                (*table)[remap[0]] = remap[1];
+            }
+            tables.push_back(table);
+        }
+        r = readStream(m_cowStream, (char *)&count, sizeof(int), nread);
+        if (r != SS_SUCCESS)
+            return r;
+        for (int i = 0; i < count; i++)
+        {
+            int entry[3];
+            r = readStream(m_cowStream, (char *)entry, sizeof(entry), nread);
+            if (r != SS_SUCCESS)
+                return r;
+            streammap_t::iterator it = m_streams.find(entry[0]);
+            TT_ASSERT(it != m_streams.end());
+            TT_ASSERT(entry[2] < (int)tables.size());
+            Stream& strm = (*it).second;
+            strm.tag = entry[1];
+            if (entry[2] >= 0)
+            {
+                strm.remap = tables[entry[2]];
+            }
+        }
+        return SS_SUCCESS;
+    }
+
+    int StructuredStorage::flushCopyOnWrite()
+    {
+        if (!m_cowDirty)
+            return SS_SUCCESS;
+        int r;
+        if (m_cowStream == -1)
+        {
+            r = createStream("CoPyOnWrItE", m_cowStream);
+            if (r != SS_SUCCESS)
+                return r;
+        }
+        std::vector<int> data;
+        data.push_back(m_nextTag);
+        data.push_back(0);
+        std::map<const remap_t *, int> tables;     // table, its index
+        streammap_t::iterator it = m_streams.begin();
+        streammap_t::iterator eit = m_streams.end();
+        while (it != eit)
+        {
+            const remap_t *table = (*it).second.remap.get();
+            if (table != nullptr && tables.find(table) == tables.end())
+            {
+                tables[table] = data[1]++;
+                data.push_back((int)table->size());
+                remap_t::const_iterator rit = table->begin();
+                remap_t::const_iterator reit = table->end();
+                while (rit != reit)
+                {
+                    data.push_back((*rit).first);
+                    data.push_back((*rit).second);
+                    ++rit;
+                }
+            }
+            ++it;
+        }
+        size_t countAt = data.size();
+        data.push_back(0);
+        it = m_streams.begin();
+        while (it != eit)
+        {
+            Stream& strm = (*it).second;
+            if (strm.tag != strm.info.streamid || strm.remap)
+            {
+                ++data[countAt];
+                data.push_back(strm.info.streamid);
+                data.push_back(strm.tag);
+                data.push_back(strm.remap ? tables[strm.remap.get()] : -1);
+            }
+            ++it;
+        }
+        r = streamSeek(m_cowStream, 0);
+        if (r != SS_SUCCESS)
+            return r;
+        r = writeStream(m_cowStream, (const char *)&data[0], (int)(data.size() * sizeof(int)));
+        if (r != SS_SUCCESS)
+            return r;
+        m_cowDirty = false;
+        return SS_SUCCESS;
+    }
+
     int StructuredStorage::flushStreamDirectory()
     {
-        TT_VERIFY(SS_SUCCESS, StreamSeek(STREAM0, 0));
+        TT_VERIFY(SS_SUCCESS, streamSeek(STREAM0, 0));
         streammap_t::iterator it = m_streams.begin();
         streammap_t::iterator eit = m_streams.end();
         while (it != eit)
         {
             Stream& strm = (*it).second;
-            TT_VERIFY(SS_SUCCESS, Write(STREAM0, (const char *)&strm.info, sizeof(streamInfo)));
+            TT_VERIFY(SS_SUCCESS, writeStream(STREAM0, (const char *)&strm.info, sizeof(streamInfo)));
+            ++it;
+        }
+        return SS_SUCCESS;
+    }
+
+    // Turn write-back mode off. The flusher writes out the cache before it exits
+    int StructuredStorage::stopWriteBack()
+    {
+        if (!m_writeBack)
+        {
+            return SS_SUCCESS;
+        }
+        {
+            lock_guard<mutex> lock(m_cacheMutex);
+            m_flushStop = true;
+        }
+        m_flushWake.notify_one();
+        m_flusher.join();
+        {
+            lock_guard<mutex> lock(m_writerMutex);
+            m_writerStop = true;
+        }
+        m_writerWake.notify_all();
+        for (size_t i = 0; i < m_stripeWriters.size(); i++)
+        {
+            m_stripeWriters[i].thread.join();
+        }
+        m_stripeWriters.clear();
+        m_writeBack = false;
+        TT_ASSERT(m_dirtyPages.empty());
+        for (size_t i = 0; i < m_cacheBuffers.size(); i++)
+        {
+            _aligned_free(m_cacheBuffers[i]);
+        }
+        m_cacheBuffers.clear();
+        _aligned_free(m_flushBuffer);
+        m_flushBuffer = nullptr;
+        int r = m_writeBackError;
+        m_writeBackError = SS_SUCCESS;
+        return r;
+    }
+
+    // Write-back mode, hold a page write until the flusher gets to it. Either
+    // part of the page may be given. A new page is written whole, its data is zeros
+    int StructuredStorage::cachePage(int offset, const pageheader *pheader, const char *data, bool newPage)
+    {
+        unique_lock<mutex> lock(m_cacheMutex);
+        if (m_writeBackError != SS_SUCCESS)
+        {
+            // The flusher failed, nothing written since can be relied on
+            return m_writeBackError;
+        }
+        cachemap_t::iterator it = m_dirtyPages.find(offset);
+        if (it == m_dirtyPages.end())
+        {
+            // Back-pressure, only once the cache is full
+            while (m_writeBackError == SS_SUCCESS
+                && m_dirtyPages.size() + m_flushingPages.size() >= (size_t)m_writeBackLimit)
+            {
+                m_flushWake.notify_one();
+                m_flushDone.wait(lock);
+            }
+            if (m_writeBackError != SS_SUCCESS)
+            {
+                return m_writeBackError;
+            }
+            CachedPage page;
+            if (m_cacheBuffers.empty())
+            {
+                page.image = (char *)_aligned_malloc(m_header.pageSize, BLOCK_SIZE);
+            }
+            else
+            {
+                page.image = m_cacheBuffers.back();
+                m_cacheBuffers.pop_back();
+            }
+            page.hasHeader = false;
+            page.hasData = false;
+            it = m_dirtyPages.insert(cachemap_t::value_type(offset, page)).first;
+            if (m_dirtyPages.size() * 2 >= (size_t)m_writeBackLimit)
+            {
+                m_flushWake.notify_one();
+            }
+        }
+        CachedPage& page = (*it).second;
+        if (pheader)
+        {
+            memcpy(page.image, pheader, sizeof(pageheader));
+            page.hasHeader = true;
+        }
+        if (data)
+        {
+            memcpy(page.image + sizeof(pageheader), data, m_pageDataSize);
+            page.hasData = true;
+        }
+        else if (newPage)
+        {
+            memset(page.image + sizeof(pageheader), 0, m_pageDataSize);
+            page.hasData = true;
+        }
+        return SS_SUCCESS;
+    }
+
+    // Write-back mode, the latest header of a page if it has not reached the file yet.
+    // Pages waiting for the flusher are newer than the ones it is writing
+    bool StructuredStorage::cachedHeader(int offset, pageheader& pheader)
+    {
+        lock_guard<mutex> lock(m_cacheMutex);
+        cachemap_t::iterator it = m_dirtyPages.find(offset);
+        if (it == m_dirtyPages.end() || !(*it).second.hasHeader)
+        {
+            it = m_flushingPages.find(offset);
+            if (it == m_flushingPages.end() || !(*it).second.hasHeader)
+                return false;
+        }
+        memcpy(&pheader, (*it).second.image, sizeof(pageheader));
+        return true;
+    }
+
+    // Write-back mode, the latest data of a page if it has not reached the file yet
+    bool StructuredStorage::cachedData(int offset, char *buf)
+    {
+        lock_guard<mutex> lock(m_cacheMutex);
+        cachemap_t::iterator it = m_dirtyPages.find(offset);
+        if (it == m_dirtyPages.end() || !(*it).second.hasData)
+        {
+            it = m_flushingPages.find(offset);
+            if (it == m_flushingPages.end() || !(*it).second.hasData)
+                return false;
+        }
+        memcpy(buf, (*it).second.image + sizeof(pageheader), m_pageDataSize);
+        return true;
+    }
+
+    // The flusher thread. Writes out the cache once it is half full, when a page
+    // has waited FLUSH_INTERVAL, and when asked to. Exits once stopped and empty
+    void StructuredStorage::flushThread()
+    {
+        unique_lock<mutex> lock(m_cacheMutex);
+        while (true)
+        {
+            // Once failed, the flusher only waits to be stopped or asked
+            m_flushWake.wait_for(lock, chrono::milliseconds(FLUSH_INTERVAL), [this] {
+                return m_flushStop || m_flushRequested
+                    || (m_writeBackError == SS_SUCCESS && m_dirtyPages.size() * 2 >= (size_t)m_writeBackLimit);
+            });
+            if (m_writeBackError != SS_SUCCESS)
+            {
+                // Pages cached during the failed batch will never be written
+                recyclePages(m_dirtyPages);
+            }
+            if (m_dirtyPages.empty() || m_writeBackError != SS_SUCCESS)
+            {
+                m_flushRequested = false;
+                m_flushDone.notify_all();
+                if (m_flushStop)
+                    break;
+                continue;
+            }
+            // Writers carry on with an empty cache while the batch is written
+            m_flushingPages.swap(m_dirtyPages);
+            lock.unlock();
+            int r = flushPages(m_flushingPages);
+            lock.lock();
+            if (r != SS_SUCCESS)
+            {
+                m_writeBackError = r;
+                recyclePages(m_dirtyPages);
+            }
+            recyclePages(m_flushingPages);
+            m_flushDone.notify_all();
+        }
+    }
+
+    // Give the images of the pages back to m_cacheBuffers, m_cacheMutex held
+    void StructuredStorage::recyclePages(cachemap_t& pages)
+    {
+        cachemap_t::iterator it = pages.begin();
+        cachemap_t::iterator eit = pages.end();
+        while (it != eit)
+        {
+            m_cacheBuffers.push_back((*it).second.image);
             ++it;
         }
+        pages.clear();
+    }
+
+    // Flusher thread, write a batch of pages. The stripes are written at the
+    // same time, the flusher takes the first one and a thread each the others
+    // Write the ranges flushPages() hands the stripe, with the stripe's staging buffer
+    void StructuredStorage::writerThread(int stripe)
+    {
+        char *buffer = m_flushBuffer + (size_t)stripe * COALESCE_PAGES * m_header.pageSize;
+        StripeWriter& writer = m_stripeWriters[stripe];
+        unique_lock<mutex> lock(m_writerMutex);
+        while (true)
+        {
+            m_writerWake.wait(lock, [this, &writer] { return m_writerStop || writer.busy; });
+            if (!writer.busy)
+            {
+                return;
+            }
+            lock.unlock();
+            int r = flushStripe(*m_flushOrder, writer.begin, writer.end, buffer);
+            lock.lock();
+            writer.result = r;
+            writer.busy = false;
+            m_writerDone.notify_one();
+        }
+    }
+
+    int StructuredStorage::flushPages(const cachemap_t& pages)
+    {
+        vector<flushitem_t> order;
+        order.reserve(pages.size());
+        cachemap_t::const_iterator it = pages.begin();
+        cachemap_t::const_iterator eit = pages.end();
+        while (it != eit)
+        {
+            int stripe;
+            long long pos = mapOffset((*it).first, 0, stripe);
+            order.push_back(flushitem_t(make_pair(stripe, pos), &(*it).second));
+            ++it;
+        }
+        sort(order.begin(), order.end());
+
+        // The range of order each stripe with pages in the batch has
+        vector<pair<size_t, size_t> > ranges;
+        size_t begin = 0;
+        for (size_t i = 1; i <= order.size(); i++)
+        {
+            if (i == order.size() || order[i].first.first != order[begin].first.first)
+            {
+                ranges.push_back(make_pair(begin, i));
+                begin = i;
+            }
+        }
+        if (m_stripeWriters.empty())
+        {
+            return ranges.empty() ? SS_SUCCESS : flushStripe(order, 0, order.size(), m_flushBuffer);
+        }
+
+        // Hand each stripe's writer its range and wait for all of them
+        unique_lock<mutex> lock(m_writerMutex);
+        m_flushOrder = &order;
+        for (size_t i = 0; i < m_stripeWriters.size(); i++)
+        {
+            m_stripeWriters[i].result = SS_SUCCESS;
+        }
+        for (size_t i = 0; i < ranges.size(); i++)
+        {
+            StripeWriter& writer = m_stripeWriters[order[ranges[i].first].first.first];
+            writer.begin = ranges[i].first;
+            writer.end = ranges[i].second;
+            writer.busy = true;
+        }
+        m_writerWake.notify_all();
+        int r = SS_SUCCESS;
+        for (size_t i = 0; i < m_stripeWriters.size(); i++)
+        {
+            StripeWriter& writer = m_stripeWriters[i];
+            m_writerDone.wait(lock, [&writer] { return !writer.busy; });
+            if (r == SS_SUCCESS)
+                r = writer.result;
+        }
+        m_flushOrder = nullptr;
+        return r;
+    }
+
+    // Write the pages of one stripe, order[begin] to order[end - 1], in file offset
+    // order. Whole pages that follow each other in the file are written together,
+    // up to COALESCE_PAGES, staged in buffer
+    int StructuredStorage::flushStripe(const vector<flushitem_t>& order, size_t begin, size_t end, char *buffer)
+    {
+        size_t i = begin;
+        while (i < end)
+        {
+            int stripe = order[i].first.first;
+            long long pos = order[i].first.second;
+            const CachedPage& page = *order[i].second;
+            if (!page.hasHeader || !page.hasData)
+            {
+                int r = flushPartialPage(stripe, pos, page, buffer);
+                if (r != SS_SUCCESS)
+                    return r;
+                ++i;
+                continue;
+            }
+            int n = 0;
+            while (i + n < end && n < COALESCE_PAGES)
+            {
+                const flushitem_t& next = order[i + n];
+                if (next.first.first != stripe || next.first.second != pos + (long long)n * m_header.pageSize
+                    || !next.second->hasHeader || !next.second->hasData)
+                {
+                    break;
+                }
+                memcpy(buffer + n * m_header.pageSize, next.second->image, m_header.pageSize);
+                ++n;
+            }
+            int size = n * m_header.pageSize;
+            if (writeFile(stripe, pos, buffer, size) != size)
+            {
+                TT_ASSERT(false);
+                return SS_ERROR;
+            }
+            i += n;
+        }
+        return SS_SUCCESS;
+    }
+
+    // Flusher thread, write the parts of a page that were cached. Buffer is the
+    // staging buffer of the page's stripe
+    int StructuredStorage::flushPartialPage(int stripe, long long pos, const CachedPage& page, char *buffer)
+    {
+        if (m_aligned)
+        {
+            // Only a header is written on its own in the aligned layout. Same
+            // read-modify-write of the first block as writePageHeader()
+            TT_ASSERT(page.hasHeader && !page.hasData);
+            if (readFile(stripe, pos, buffer, BLOCK_SIZE) != BLOCK_SIZE)
+            {
+                TT_ASSERT(false);
+                return SS_ERROR;
+            }
+            memcpy(buffer, page.image, sizeof(pageheader));
+            if (writeFile(stripe, pos, buffer, BLOCK_SIZE) != BLOCK_SIZE)
+            {
+                TT_ASSERT(false);
+                return SS_ERROR;
+            }
+            return SS_SUCCESS;
+        }
+        if (page.hasHeader && writeFile(stripe, pos, page.image, sizeof(pageheader)) != sizeof(pageheader))
+        {
+            TT_ASSERT(false);
+            return SS_ERROR;
+        }
+        if (page.hasData && writeFile(stripe, pos + sizeof(pageheader), page.image + sizeof(pageheader),
+            m_pageDataSize) != m_pageDataSize)
+        {
+            TT_ASSERT(false);
+            return SS_ERROR;
+        }
         return SS_SUCCESS;
     }
 }
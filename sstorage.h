@@ -4,10 +4,15 @@
 #define __IDEMPOTENT_TRANSACTION_COUNTING_SSTORAGE_H_
 
 #include "boost/noncopyable.hpp"
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace structuredstorage_ns
 {
     class StructuredStorage;
+    struct StorageTrace;
 
     enum
     {
@@ -22,11 +27,40 @@ namespace structuredstorage_ns
         SS_UNKNOWN_VERSION,     // Unsupported version
         SS_NOT_OPENED,          // Storage is not opened
         SS_ALREADY_OPENED,      // Storage is already opened
-        SS_NOT_FOUND            // Stream name not found
+        SS_NOT_FOUND,           // Stream name not found
+        SS_BAD_PAGESIZE,        // Page size not valid for the requested layout
+        SS_NOT_ALIGNED,         // Direct I/O requested on a storage without the aligned layout
+        SS_TOO_LARGE,           // Key or value too large, or a stream would pass INT_MAX bytes
+        SS_STRIPE_MISMATCH      // Files given do not match the stripes of the storage
+    };
+
+    // Options for CreateStorage() and OpenStorage()
+    enum
+    {
+        SS_ALIGNED = 1,         // Create only. Header takes a full block and pages are
+                                // block aligned. Page size must be a multiple of the block size
+        SS_DIRECT_IO = 2,       // Bypass the OS page cache (O_DIRECT, unbuffered write-through handle
+                                // on Windows). Implies SS_ALIGNED on create,
+                                // requires an aligned storage on open
+        SS_LARGE = 4            // Create only. Pages are addressed by number rather than by file
+                                // offset, so the storage is not limited to 2 GB. Always used for
+                                // striped storages. Older code cannot open such a storage.
+                                // A single stream is still limited to INT_MAX bytes, a Write
+                                // past that fails with SS_TOO_LARGE
     };
 
     class Position
     {
+    public:
+        // Ordering only, so Positions can be used as keys
+        bool operator<(const Position& other) const
+        {
+            if (fileOffsetPage != other.fileOffsetPage)
+                return fileOffsetPage < other.fileOffsetPage;
+            if (offsetInPage != other.offsetInPage)
+                return offsetInPage < other.offsetInPage;
+            return streamOffset < other.streamOffset;
+        }
     private:
         int fileOffsetPage;
         int offsetInPage;
@@ -40,10 +74,18 @@ namespace structuredstorage_ns
         StructuredStorage();
         ~StructuredStorage();
         // Open a storage file
-        int OpenStorage(const char *filename);
+        int OpenStorage(const char *filename, int options = 0);
 
         // Create a storage file
-        int CreateStorage(const char *filename, int pageSize = 1024);
+        int CreateStorage(const char *filename, int pageSize = 1024, int options = 0);
+
+        // Open a storage striped across several files. The files must be given
+        // in the same order as to CreateStripedStorage()
+        int OpenStripedStorage(const char **filenames, int count, int options = 0);
+
+        // Create a storage striped across count files, typically on different devices.
+        // Pages are dealt round robin to the files
+        int CreateStripedStorage(const char **filenames, int count, int pageSize = 1024, int options = 0);
 
         // Close the storage file
         int CloseStorage();
@@ -51,6 +93,10 @@ namespace structuredstorage_ns
         // Create a stream
         int CreateStream(const char *name, int& streamid);
 
+        // Create a stream with the same contents as an existing one. No data is
+        // copied, the two streams share pages until one of them writes to a page
+        int CloneStream(int streamid, const char *name, int& newStreamid);
+
         // Open a stream
         int OpenStream(const char *name, int& streamid);
 
@@ -68,12 +114,48 @@ namespace structuredstorage_ns
         // Get the stream position
         int StreamPosition(int streamid, int& pos);
 
+        // Get the size of a stream
+        int StreamSize(int streamid, int& size);
+
+        // Streams are numbered from 0 to StreamCount() - 1. Some of the ids are
+        // used by the storage itself, StreamSize() fails for those
+        int StreamCount() const { return (int)m_streams.size(); }
+
         //FilePosition are much faster then stream positions. However
         // you cannot manipulate the position
         int FileSeek(int streamid, const Position& pos);
 
         // Get the current file position of the given stream
         int FilePosition(int streamid, Position& pos);
+
+        // Number of stream bytes held by one page
+        int PageDataSize() const { return m_pageDataSize; }
+
+        // Return the page buffer of a stream to the pool once the stream has not
+        // been accessed for this many milliseconds. 0, the default, never releases
+        void SetIdleRelease(int milliseconds);
+
+        // Release the page buffers of all idle streams now. Idle streams are otherwise
+        // only looked for when some stream is accessed
+        int ReleaseIdleBuffers();
+
+        // Write-back mode. Page writes are held in a cache of up to maxDirtyPages
+        // pages and written by a background thread, Write() only waits when the
+        // cache is full. 0, the default, writes pages as they are done with.
+        // Turning it off or changing the limit writes the cache out first
+        int SetWriteBack(int maxDirtyPages);
+
+        // Wait until the write-back cache has been written to the files. Does not
+        // write the pages streams are still working on, CloseStorage() does that
+        int FlushWriteBack();
+
+        // Trace the calls above to the given file, truncating it. If the storage is
+        // open the trace starts with the streams it has. See sstrace.h for the format
+        // and ssreplay.cpp to replay a trace
+        int StartTrace(const char *filename);
+
+        // Flush and close the trace file
+        int StopTrace();
     private:
         struct fileheader
         {
@@ -81,14 +163,23 @@ namespace structuredstorage_ns
             int version;
             int fileOffsetFirstFreePage;    // First page on free list
             int fileOffsetFirstPageStream0; // First page of stream 0. The first page probably
-                                            // immediately follows this header
+                                            // immediately follows this header. For
+                                            // VERSION_PAGE_ADDRESSED the file offset of the
+                                            // first page in every stripe, stream 0 starts at page 1
             int numstreams;                 // Number of streams in this storage
             int pageSize;                   // Page size for this storage file
+            // VERSION_PAGE_ADDRESSED and up only
+            int flags;                      // HEADER_ALIGNED
+            int stripes;                    // Number of files the pages are striped across
+            int stripeIndex;                // Which of them this is. Files other than 0 only
+                                            // hold a copy of the header, to identify them
         };
 
+        // Page offsets here, in streamInfo, the free list and Positions are storage
+        // offsets, see mapOffset(). In a VERSION_PAGE_ADDRESSED storage they are page numbers
         struct pageheader
         {
-            int streamid;          // -1 page is free
+            int streamid;          // -1 page is free. Owner tag of the page, see Stream::tag
             int usedBytes;       // Number of bytes used in tis page
             int fileOffsetNextPage;  // Offset of the next page in this stream
             int fileOffsetThisPage;  // File offset of this page
@@ -98,8 +189,17 @@ namespace structuredstorage_ns
         {
             MAGIC_NUM = 0xff783445,
             VERSION_NUM = 1,
+            VERSION_ALIGNED = 2,    // Same header, but block aligned layout
+            VERSION_PAGE_ADDRESSED = 3, // Header has flags and stripes, page offsets are page numbers
+            HEADER_ALIGNED = 1,     // fileheader::flags, block aligned layout
             STREAM0 = 0,
             MAX_STREAM_NAME = 32,
+            BLOCK_SIZE = 4096,      // Alignment unit of the aligned layout
+            BUFFER_ALIGN = 64,      // Page buffer alignment when not using the aligned layout
+            BUFFERS_PER_SLAB = 32,  // Page buffers allocated at a time by the pool
+            FIRST_CLONE_TAG = 0x10000000,   // Owner tags handed out by CloneStream()
+            FLUSH_INTERVAL = 100,   // Milliseconds a write-back page may wait for a flush
+            COALESCE_PAGES = 32,    // Most pages written by the flusher in one write
         };
 
         struct streamInfo
@@ -109,6 +209,7 @@ namespace structuredstorage_ns
             int fileOffsetPage0;    // For this stream, the file offset of the first page
             int streamsize;     // Number of bytes in this stream
         };
+        typedef std::map<int, int> remap_t;    // Shared page, this stream's copy of it
         struct Stream
         {
             streamInfo info;
@@ -117,21 +218,124 @@ namespace structuredstorage_ns
             int currentStreamPos;
             int currentPagePos;     // 0 thru pageheader.usedbytes-1
             bool dirty;             // Needs to be written
+            bool loaded;            // currentPage is valid, see loadStream()
+            long long lastAccess;   // Milliseconds, for idle release of pageData
+            int tag;                // Pages with this owner tag may be written in place, others
+                                    // are shared with a clone and copied first. streamid until cloned
+            std::shared_ptr<remap_t> remap; // Null until the first copy. Clones share the
+                                            // table until one of them copies a page
+            int currentLink;        // Offset currentPage was reached by, before remapping. It is
+                                    // what Positions hold, so they stay good when the page is copied
+        };
+        struct CachedPage
+        {
+            char *image;            // Whole page, page size and block aligned
+            bool hasHeader;         // Parts of image that were written. A part that
+            bool hasData;           // was not is read from the file
+        };
+        typedef std::map<int, CachedPage> cachemap_t;  // storage offset, page
+        typedef std::pair<std::pair<int, long long>, const CachedPage *> flushitem_t;  // (stripe, file position), page
+        struct StripeWriter
+        {
+            std::thread thread;
+            size_t begin;           // Range of the batch to write
+            size_t end;
+            bool busy;              // Has a range it has not finished
+            int result;
         };
 
-        int m_fd;
+        int m_fd;                   // Stripe 0, which holds the header
+        std::vector<int> m_fds;     // All stripes, m_fd is the first
+        int m_fileEnd;              // Storage offset where the next new page goes
+        bool m_pageAddressed;       // Storage offsets are page numbers, VERSION_PAGE_ADDRESSED
         typedef  std::map<int, Stream> streammap_t;
         streammap_t m_streams;     // stream id, stream
         fileheader m_header;
         int m_pageDataSize;
+        bool m_aligned;             // Aligned layout, all I/O is whole blocks or pages
+        char *m_ioBuffer;           // Block aligned buffer of one page for headers and new pages,
+                                    // aligned layout only
+        std::vector<char *> m_slabs;        // Page buffer pool, BUFFERS_PER_SLAB buffers each
+        std::vector<char *> m_freeBuffers;  // Page buffers not held by any stream
+        int m_idleRelease;                  // Milliseconds, 0 is never
+        long long m_lastIdleScan;
+        int m_cowStream;                    // Clone tags and remaps, -1 until the first clone
+        int m_nextTag;
+        bool m_cowDirty;                    // Tags or remaps changed since open
+        bool m_writeBack;                   // Page writes go to the cache, see SetWriteBack()
+        int m_writeBackLimit;
+        int m_writeBackError;               // First error of the flusher, reported by later calls
+        cachemap_t m_dirtyPages;            // Waiting for the flusher
+        cachemap_t m_flushingPages;         // Being written by the flusher, still read from
+        std::vector<char *> m_cacheBuffers; // Free page images
+        char *m_flushBuffer;                // Flusher's staging buffers, COALESCE_PAGES pages per stripe
+        bool m_flushStop;
+        bool m_flushRequested;
+        std::thread m_flusher;
+        std::mutex m_cacheMutex;            // The above, from m_dirtyPages on
+        std::condition_variable m_flushWake;    // Flusher has work
+        std::condition_variable m_flushDone;    // Flusher finished a batch
+        std::vector<StripeWriter> m_stripeWriters;      // One per stripe of a striped storage, the
+        const std::vector<flushitem_t> *m_flushOrder;   // flusher hands each its stripe's range of a batch
+        bool m_writerStop;
+        std::mutex m_writerMutex;           // The writers' ranges and results
+        std::condition_variable m_writerWake;   // Writers have ranges
+        std::condition_variable m_writerDone;   // A writer finished its range
+        std::vector<std::unique_ptr<std::mutex> > m_fileMutexes;   // One per stripe, held over a seek
+                                                                    // and its transfer. The flusher shares the files
+        std::unique_ptr<StorageTrace> m_trace;  // Null when not tracing
     private:
+        // The public calls without tracing, for use by the storage itself
+        int openStripedStorage(const char **filenames, int count, int options);
+        int createStripedStorage(const char **filenames, int count, int pageSize, int options);
+        int closeStorage();
+        int createStream(const char *name, int& streamid);
+        int cloneStream(int streamid, const char *name, int& newStreamid);
+        int openStream(const char *name, int& streamid);
+        int readStream(int streamid, char *buf, int bytesToRead, int& bytesRead);
+        int writeStream(int streamid, const char *buf, int bytesToWrite);
+        int streamSeek(int streamid, int streamOffset);
+        int streamPosition(int streamid, int& pos);
+        int fileSeek(int streamid, const Position& pos);
+        int filePosition(int streamid, Position& pos);
+        int releaseIdleBuffers();
+        int setWriteBack(int maxDirtyPages);
+        int flushWriteBack();
+
+        long long beginCall();
+        void endCall(long long start, int op, int result, int streamid, int arg = 0, int arg2 = 0);
+        int positionToken(const Position& pos, bool add);
+        void traceStreams();
+        int flushTrace();
+
         int loadStreams();
+        int loadStream(Stream& strm);
+        void touchStream(Stream& strm);
+        int releaseStreamBuffer(Stream& strm);
+        char *allocPageBuffer();
+        void freePageBuffer(char *buf);
+        void freePagePool();
         int writeStorageHeader();
         int readStorageHeader();
+        int headerSize() const;
+        int writeStripeHeaders();
+        int openFiles(const char **filenames, int count, int flags, bool direct);
+        void closeFiles();
+        int firstPage() const;
+        long long mapOffset(int offset, int offsetInPage, int& stripe) const;
+        int readFile(int stripe, long long pos, void *buf, int size);
+        int writeFile(int stripe, long long pos, const void *buf, int size);
+        int readAt(int offset, int offsetInPage, void *buf, int size);
+        int writeAt(int offset, int offsetInPage, const void *buf, int size);
+        int allocFileEnd();
         int readPageHeader(int offset, pageheader& pheader);
         int writePageHeader(pageheader& pheader);
         int readPageData(pageheader&, char *buf);
-        int writePageData(pageheader&, const char *buf);
+        int writePageData(pageheader&, char *buf);
+        int writeNewPage(pageheader& pheader);
+        int writePage(pageheader& pheader, char *buf);
+        int readAligned(int offset, int size, char *buf);
+        int writeAligned(int offset, int size, const char *buf);
         int loadNextPage(Stream& strm);
         int readblock(Stream& strm, char *buf, int bytesToRead);
         int writeblock(Stream& strm, const char *buf, int bytesToWrite);
@@ -139,7 +343,22 @@ namespace structuredstorage_ns
         int allocNewPage(Stream& strm);
         int allocNewPageFromFreeList(Stream& strm);
         int allocNewPageFromDisk(Stream& strm);
+        int allocPage(pageheader& pheader);
+        int copyOnWrite(Stream& strm);
+        int resolvePage(const Stream& strm, int offset) const;
+        int loadCopyOnWrite();
+        int flushCopyOnWrite();
         int flushStreamDirectory();
+        int stopWriteBack();
+        int cachePage(int offset, const pageheader *pheader, const char *data, bool newPage = false);
+        bool cachedHeader(int offset, pageheader& pheader);
+        bool cachedData(int offset, char *buf);
+        void flushThread();
+        void writerThread(int stripe);
+        void recyclePages(cachemap_t& pages);
+        int flushPages(const cachemap_t& pages);
+        int flushStripe(const std::vector<flushitem_t>& order, size_t begin, size_t end, char *buffer);
+        int flushPartialPage(int stripe, long long pos, const CachedPage& page, char *buffer);
     };
 }
 
@@ -0,0 +1,155 @@
+#include "pch.h"
+#include "sstrace.h"
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <chrono>
+
+using namespace std;
+using namespace tt_core_ns;
+
+namespace
+{
+    const size_t RECORDS_PER_FLUSH = 4096;
+
+    long long nowMicroseconds()
+    {
+        return chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    }
+}
+
+namespace structuredstorage_ns
+{
+    int StructuredStorage::StartTrace(const char *filename)
+    {
+        if (m_trace)
+        {
+            return SS_ALREADY_OPENED;
+        }
+        int fd = _open(filename, O_WRONLY | O_CREAT | O_TRUNC, _S_IREAD | _S_IWRITE);
+        if (fd < 0)
+        {
+            return SS_ERROR;
+        }
+        traceheader header;
+        header.magic = TRACE_MAGIC;
+        header.version = TRACE_VERSION;
+        header.recordSize = sizeof(tracerecord);
+        if (_write(fd, &header, sizeof(header)) != sizeof(header))
+        {
+            _close(fd);
+            return SS_ERROR;
+        }
+        m_trace.reset(new StorageTrace);
+        m_trace->fd = fd;
+        m_trace->records.reserve(RECORDS_PER_FLUSH);
+        traceStreams();
+        m_trace->lastStart = nowMicroseconds();
+        return SS_SUCCESS;
+    }
+
+    int StructuredStorage::StopTrace()
+    {
+        if (!m_trace)
+        {
+            return SS_NOT_OPENED;
+        }
+        int r = flushTrace();
+        _close(m_trace->fd);
+        m_trace.reset();
+        return r;
+    }
+
+/****************************************************************************
+* Internal implementaion methods
+*/
+    // Called at the start of a public call, the time it started
+    long long StructuredStorage::beginCall()
+    {
+        if (!m_trace)
+            return 0;
+        return nowMicroseconds();
+    }
+
+    // Append a record for a public call that started at start
+    void StructuredStorage::endCall(long long start, int op, int result, int streamid, int arg, int arg2)
+    {
+        if (!m_trace)
+            return;
+        tracerecord rec;
+        rec.op = (short)op;
+        rec.result = (short)result;
+        rec.streamid = streamid;
+        rec.arg = arg;
+        rec.arg2 = arg2;
+        rec.startDelta = (unsigned int)(start - m_trace->lastStart);
+        rec.duration = (unsigned int)(nowMicroseconds() - start);
+        m_trace->lastStart = start;
+        m_trace->records.push_back(rec);
+        if (op == TRACE_CLOSE_STORAGE)
+        {
+            // Positions do not survive the storage
+            m_trace->positionTokens.clear();
+        }
+        if (m_trace->records.size() >= RECORDS_PER_FLUSH)
+        {
+            TT_VERIFY(SS_SUCCESS, flushTrace());
+        }
+    }
+
+    // The token a Position is traced as. FilePosition() adds, the same Position
+    // always getting the same token. FileSeek() gets -1 for a Position that was
+    // not taken while tracing
+    int StructuredStorage::positionToken(const Position& pos, bool add)
+    {
+        std::map<Position, int>& tokens = m_trace->positionTokens;
+        if (!add)
+        {
+            std::map<Position, int>::iterator it = tokens.find(pos);
+            return it == tokens.end() ? -1 : (*it).second;
+        }
+        int token = (int)tokens.size();
+        std::pair<std::map<Position, int>::iterator, bool> ins =
+            tokens.insert(std::map<Position, int>::value_type(pos, token));
+        return (*ins.first).second;
+    }
+
+    // Record the streams of the storage, if it is open, so that a replay can
+    // create them with their sizes before it starts timing calls
+    void StructuredStorage::traceStreams()
+    {
+        int count = StreamCount();
+        for (int i = 0; i < count; i++)
+        {
+            tracerecord rec;
+            if (StreamSize(i, rec.arg) != SS_SUCCESS)
+                continue;       // Used by the storage itself
+            streamPosition(i, rec.arg2);
+            rec.op = TRACE_STREAM_STATE;
+            rec.result = SS_SUCCESS;
+            rec.streamid = i;
+            rec.startDelta = 0;
+            rec.duration = 0;
+            m_trace->records.push_back(rec);
+        }
+    }
+
+    // Write the buffered records to the trace file
+    int StructuredStorage::flushTrace()
+    {
+        TT_ASSERT(m_trace != nullptr);
+        std::vector<tracerecord>& records = m_trace->records;
+        if (records.empty())
+            return SS_SUCCESS;
+        int size = (int)(records.size() * sizeof(tracerecord));
+        int r = _write(m_trace->fd, &records[0], size);
+        records.clear();
+        if (r != size)
+        {
+            TT_ASSERT(false);
+            return SS_ERROR;
+        }
+        return SS_SUCCESS;
+    }
+}
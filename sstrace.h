@@ -0,0 +1,72 @@
+#pragma once
+
+#ifndef __IDEMPOTENT_TRANSACTION_COUNTING_SSTRACE_H_
+#define __IDEMPOTENT_TRANSACTION_COUNTING_SSTRACE_H_
+
+#include "sstorage.h"
+
+namespace structuredstorage_ns
+{
+    // Trace file layout, see StructuredStorage::StartTrace(): a traceheader followed
+    // by tracerecords. Only sizes, ids and timing are recorded, never stream names
+    // or data, so a trace can be replayed (see ssreplay.cpp) without access to the
+    // original storage.
+    enum
+    {
+        TRACE_MAGIC = 0xff783446,
+        TRACE_VERSION = 4,          // 2 adds TRACE_STREAM_STATE and the OpenStream args,
+                                    // 3 the stripe count of the storage calls,
+                                    // 4 the write-back and idle release calls
+    };
+
+    enum
+    {
+        TRACE_CREATE_STORAGE = 1,   // streamid = stripes, arg = pageSize, arg2 = options
+        TRACE_OPEN_STORAGE,         // streamid = stripes, arg2 = options
+        TRACE_CLOSE_STORAGE,
+        TRACE_CREATE_STREAM,        // streamid = the new stream
+        TRACE_OPEN_STREAM,          // streamid = the opened stream, arg = its size, arg2 = its position
+        TRACE_READ,                 // arg = bytesToRead, arg2 = bytesRead
+        TRACE_WRITE,                // arg = bytesToWrite
+        TRACE_STREAM_SEEK,          // arg = stream offset
+        TRACE_STREAM_POSITION,      // arg = the position
+        TRACE_FILE_SEEK,            // arg = position token, -1 if it was not taken while tracing
+        TRACE_FILE_POSITION,        // arg = position token, numbered from 0 in trace order
+        TRACE_CLONE_STREAM,         // streamid = the source, arg = the new stream
+        TRACE_STREAM_STATE,         // Not a call. A stream that exists when the trace is started,
+                                    // arg = its size, arg2 = its position
+        TRACE_SET_WRITE_BACK,       // arg = maxDirtyPages
+        TRACE_FLUSH_WRITE_BACK,
+        TRACE_SET_IDLE_RELEASE,     // arg = milliseconds
+        TRACE_RELEASE_IDLE_BUFFERS,
+    };
+
+    struct traceheader
+    {
+        int magic;
+        int version;
+        int recordSize;             // sizeof(tracerecord)
+    };
+
+    struct tracerecord
+    {
+        short op;
+        short result;               // SS_ return code
+        int streamid;
+        int arg;
+        int arg2;
+        unsigned int startDelta;    // Microseconds since the start of the previous record
+        unsigned int duration;      // Microseconds spent in the call
+    };
+
+    // Kept by a StructuredStorage while it is tracing
+    struct StorageTrace
+    {
+        int fd;                                     // Trace file
+        std::vector<tracerecord> records;           // Not yet written to the trace file
+        std::map<Position, int> positionTokens;     // Position, token
+        long long lastStart;                        // Microseconds
+    };
+}
+
+#endif // __IDEMPOTENT_TRANSACTION_COUNTING_SSTRACE_H_
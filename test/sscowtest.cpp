@@ -0,0 +1,139 @@
+#include "pch.h"
+#include "sstorage.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace structuredstorage_ns;
+
+// Regression tests for CloneStream(). Build together with the storage sources
+// and run from a scratch directory. Returns 0 when all pass, prints the first
+// failing check otherwise
+
+#define CHECK(expr) \
+    if (!(expr)) \
+    { \
+        printf("FAILED %s(%d): %s\n", __FILE__, __LINE__, #expr); \
+        return 1; \
+    }
+
+namespace
+{
+    const char *STORAGE_FILE = "sscowtest.ss";
+
+    // Read count bytes at pos and compare them with expected
+    bool readAt(StructuredStorage& ss, int streamid, const Position& pos, const char *expected, int count)
+    {
+        char buf[256];
+        int nread = 0;
+        if (ss.FileSeek(streamid, pos) != SS_SUCCESS)
+            return false;
+        if (ss.Read(streamid, buf, count, nread) != SS_SUCCESS || nread != count)
+            return false;
+        return memcmp(buf, expected, count) == 0;
+    }
+
+    // A Position taken on a page that is already a copy must survive the next clone
+    int testPositionAfterClones(int pageSize)
+    {
+        StructuredStorage ss;
+        CHECK(ss.CreateStorage(STORAGE_FILE, pageSize) == SS_SUCCESS);
+        int s, c1, c2;
+        CHECK(ss.CreateStream("s", s) == SS_SUCCESS);
+        CHECK(ss.Write(s, "aaaa", 4) == SS_SUCCESS);
+        CHECK(ss.CloneStream(s, "c1", c1) == SS_SUCCESS);
+        Position before;
+        CHECK(ss.FilePosition(s, before) == SS_SUCCESS);
+        CHECK(ss.Write(s, "bbbb", 4) == SS_SUCCESS);
+        Position pos;
+        CHECK(ss.FilePosition(s, pos) == SS_SUCCESS);
+        CHECK(ss.CloneStream(s, "c2", c2) == SS_SUCCESS);
+        CHECK(ss.Write(s, "cccc", 4) == SS_SUCCESS);
+        CHECK(readAt(ss, s, pos, "cccc", 4));
+        // Positions of one stream are good for its clones
+        CHECK(readAt(ss, s, before, "bbbb", 4));
+        CHECK(readAt(ss, c1, before, "", 0));
+        CHECK(readAt(ss, c2, before, "bbbb", 4));
+        CHECK(ss.CloseStorage() == SS_SUCCESS);
+
+        CHECK(ss.OpenStorage(STORAGE_FILE) == SS_SUCCESS);
+        CHECK(readAt(ss, s, pos, "cccc", 4));
+        CHECK(readAt(ss, c2, before, "bbbb", 4));
+        CHECK(ss.CloseStorage() == SS_SUCCESS);
+        return 0;
+    }
+
+    // Positions across several pages, each copied several times by repeated clones.
+    // The source and every clone must read their own contents back
+    int testManyClones(int pageSize)
+    {
+        const int RECORDS = 200;
+        const int CLONES = 8;
+        StructuredStorage ss;
+        CHECK(ss.CreateStorage(STORAGE_FILE, pageSize) == SS_SUCCESS);
+        int s;
+        CHECK(ss.CreateStream("s", s) == SS_SUCCESS);
+        Position positions[RECORDS];
+        char rec[16];
+        for (int i = 0; i < RECORDS; i++)
+        {
+            CHECK(ss.FilePosition(s, positions[i]) == SS_SUCCESS);
+            sprintf(rec, "%07d-%07d", i, 0);
+            CHECK(ss.Write(s, rec, sizeof(rec)) == SS_SUCCESS);
+        }
+        int clones[CLONES];
+        for (int c = 0; c < CLONES; c++)
+        {
+            char name[16];
+            sprintf(name, "clone%d", c);
+            CHECK(ss.CloneStream(s, name, clones[c]) == SS_SUCCESS);
+            // Rewrite every other record in the source, through the old Positions
+            for (int i = c % 2; i < RECORDS; i += 2)
+            {
+                CHECK(ss.FileSeek(s, positions[i]) == SS_SUCCESS);
+                sprintf(rec, "%07d-%07d", i, c + 1);
+                CHECK(ss.Write(s, rec, sizeof(rec)) == SS_SUCCESS);
+            }
+        }
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (int i = 0; i < RECORDS; i++)
+            {
+                // Record i was last written by the pass of the last clone c with c % 2 == i % 2
+                int last = (i % 2 == (CLONES - 1) % 2) ? CLONES : CLONES - 1;
+                sprintf(rec, "%07d-%07d", i, last);
+                CHECK(readAt(ss, s, positions[i], rec, sizeof(rec)));
+                for (int c = 0; c < CLONES; c++)
+                {
+                    // Clone c was taken after c passes
+                    int version = 0;
+                    for (int p = 0; p < c; p++)
+                    {
+                        if (i % 2 == p % 2)
+                            version = p + 1;
+                    }
+                    sprintf(rec, "%07d-%07d", i, version);
+                    CHECK(readAt(ss, clones[c], positions[i], rec, sizeof(rec)));
+                }
+            }
+            CHECK(ss.CloseStorage() == SS_SUCCESS);
+            CHECK(ss.OpenStorage(STORAGE_FILE) == SS_SUCCESS);
+        }
+        CHECK(ss.CloseStorage() == SS_SUCCESS);
+        return 0;
+    }
+}
+
+int main()
+{
+    int pageSizes[] = { 1024, 4096 };
+    for (int i = 0; i < 2; i++)
+    {
+        if (testPositionAfterClones(pageSizes[i]) != 0)
+            return 1;
+        if (testManyClones(pageSizes[i]) != 0)
+            return 1;
+    }
+    remove(STORAGE_FILE);
+    printf("PASSED\n");
+    return 0;
+}
@@ -0,0 +1,203 @@
+#include "pch.h"
+#include "sstorage.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#ifndef _WIN32
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+using namespace structuredstorage_ns;
+
+// Tests for write-back mode, see StructuredStorage::SetWriteBack(). Build together
+// with the storage sources and run from a scratch directory. Returns 0 when all
+// pass, prints the first failing check otherwise. The write error test needs a
+// build where TT_ASSERT does not stop on the failed writes
+
+#define CHECK(expr) \
+    if (!(expr)) \
+    { \
+        printf("FAILED %s(%d): %s\n", __FILE__, __LINE__, #expr); \
+        return 1; \
+    }
+
+namespace
+{
+    const char *STRIPE_FILES[] = { "sswritebacktest.ss", "sswritebacktest.ss.1", "sswritebacktest.ss.2" };
+    const int STREAMS = 3;
+    const int STREAM_SIZE = 300000;
+
+    // What a stream holds at an offset, after rewrite passes over it
+    char expectedByte(int stream, int offset, int passes)
+    {
+        return (char)(stream * 31 + offset * 7 + passes);
+    }
+
+    void fill(std::vector<char>& buf, int stream, int offset, int passes)
+    {
+        for (size_t i = 0; i < buf.size(); i++)
+        {
+            buf[i] = expectedByte(stream, offset + (int)i, passes);
+        }
+    }
+
+    bool verify(StructuredStorage& ss, int streamid, int stream, int passes)
+    {
+        std::vector<char> buf(STREAM_SIZE);
+        int nread = 0;
+        if (ss.StreamSeek(streamid, 0) != SS_SUCCESS)
+            return false;
+        if (ss.Read(streamid, &buf[0], STREAM_SIZE, nread) != SS_SUCCESS || nread != STREAM_SIZE)
+            return false;
+        for (int i = 0; i < STREAM_SIZE; i++)
+        {
+            // The first half is rewritten by every pass, the second half only by the first
+            if (buf[i] != expectedByte(stream, i, i < STREAM_SIZE / 2 ? passes : 0))
+                return false;
+        }
+        return true;
+    }
+
+    // Reads see the writes still in the cache, and everything is there after reopening
+    int testReadYourWrites(int stripes, int pageSize, int options, int maxDirtyPages)
+    {
+        const int PASSES = 4;
+        StructuredStorage ss;
+        CHECK(ss.CreateStripedStorage(STRIPE_FILES, stripes, pageSize, options) == SS_SUCCESS);
+        CHECK(ss.SetWriteBack(maxDirtyPages) == SS_SUCCESS);
+        int ids[STREAMS];
+        char name[16];
+        for (int s = 0; s < STREAMS; s++)
+        {
+            sprintf(name, "s%d", s);
+            CHECK(ss.CreateStream(name, ids[s]) == SS_SUCCESS);
+        }
+        // Odd sized writes to all streams in turn, so that pages of different
+        // streams are interleaved in the cache and partly written pages are flushed
+        std::vector<char> buf;
+        for (int offset = 0; offset < STREAM_SIZE; offset += (int)buf.size())
+        {
+            buf.resize(offset + 777 < STREAM_SIZE ? 777 : STREAM_SIZE - offset);
+            for (int s = 0; s < STREAMS; s++)
+            {
+                fill(buf, s, offset, 0);
+                CHECK(ss.Write(ids[s], &buf[0], (int)buf.size()) == SS_SUCCESS);
+            }
+        }
+        for (int pass = 1; pass <= PASSES; pass++)
+        {
+            for (int s = 0; s < STREAMS; s++)
+            {
+                CHECK(ss.StreamSeek(ids[s], 0) == SS_SUCCESS);
+                buf.resize(STREAM_SIZE / 2);
+                fill(buf, s, 0, pass);
+                CHECK(ss.Write(ids[s], &buf[0], (int)buf.size()) == SS_SUCCESS);
+            }
+            for (int s = 0; s < STREAMS; s++)
+            {
+                CHECK(verify(ss, ids[s], s, pass));
+            }
+        }
+        CHECK(ss.FlushWriteBack() == SS_SUCCESS);
+        CHECK(ss.CloseStorage() == SS_SUCCESS);
+
+        CHECK(ss.OpenStripedStorage(STRIPE_FILES, stripes, options & SS_DIRECT_IO) == SS_SUCCESS);
+        for (int s = 0; s < STREAMS; s++)
+        {
+            sprintf(name, "s%d", s);
+            CHECK(ss.OpenStream(name, ids[s]) == SS_SUCCESS);
+            CHECK(verify(ss, ids[s], s, PASSES));
+        }
+        CHECK(ss.CloseStorage() == SS_SUCCESS);
+        return 0;
+    }
+
+#ifndef _WIN32
+    void timedOut(int)
+    {
+        printf("FAILED: write-back hung after a write error\n");
+        fflush(stdout);
+        _exit(1);
+    }
+
+    // A flusher that cannot write, here because of a file size limit standing in
+    // for a full disk, fails the later calls instead of hanging them
+    int testWriteError(int pageSize, int options, int maxDirtyPages)
+    {
+        StructuredStorage ss;
+        if ((options & SS_DIRECT_IO) && ss.CreateStorage(STRIPE_FILES[0], pageSize, options) != SS_SUCCESS)
+        {
+            // No direct I/O on this file system
+            options &= ~SS_DIRECT_IO;
+        }
+        else if (options & SS_DIRECT_IO)
+        {
+            CHECK(ss.CloseStorage() == SS_SUCCESS);
+        }
+        CHECK(ss.CreateStorage(STRIPE_FILES[0], pageSize, options) == SS_SUCCESS);
+        CHECK(ss.SetWriteBack(maxDirtyPages) == SS_SUCCESS);
+        int id;
+        CHECK(ss.CreateStream("s", id) == SS_SUCCESS);
+
+        rlimit saved;
+        getrlimit(RLIMIT_FSIZE, &saved);
+        rlimit limit = saved;
+        limit.rlim_cur = 16 * 1024 * 1024;
+        signal(SIGXFSZ, SIG_IGN);
+        signal(SIGALRM, timedOut);
+        alarm(60);
+        setrlimit(RLIMIT_FSIZE, &limit);
+
+        std::vector<char> buf(1024 * 1024, 'x');
+        int r = SS_SUCCESS;
+        for (int i = 0; i < 64 && r == SS_SUCCESS; i++)
+        {
+            r = ss.Write(id, &buf[0], (int)buf.size());
+        }
+        int written = r;
+        int flushed = ss.FlushWriteBack();
+        int again = ss.Write(id, &buf[0], 100);
+        int closed = ss.CloseStorage();
+
+        setrlimit(RLIMIT_FSIZE, &saved);
+        alarm(0);
+        CHECK(written != SS_SUCCESS || flushed != SS_SUCCESS);
+        CHECK(again != SS_SUCCESS);
+        CHECK(closed != SS_SUCCESS);
+        return 0;
+    }
+#endif
+}
+
+int main()
+{
+    if (testReadYourWrites(1, 1024, 0, 4) != 0)
+        return 1;
+    if (testReadYourWrites(1, 4096, SS_ALIGNED, 16) != 0)
+        return 1;
+    if (testReadYourWrites(3, 1024, 0, 8) != 0)
+        return 1;
+    if (testReadYourWrites(3, 8192, SS_ALIGNED, 64) != 0)
+        return 1;
+#ifndef _WIN32
+    if (testWriteError(1024, 0, 64) != 0)
+        return 1;
+    // The hang this guards against depends on how far the writer gets ahead
+    // of the failing flusher, give it a few chances
+    for (int i = 0; i < 5; i++)
+    {
+        if (testWriteError(4096, SS_DIRECT_IO, 64) != 0)
+            return 1;
+        if (testWriteError(4096, SS_DIRECT_IO, 1024) != 0)
+            return 1;
+    }
+#endif
+    for (int i = 0; i < 3; i++)
+    {
+        remove(STRIPE_FILES[i]);
+    }
+    printf("PASSED\n");
+    return 0;
+}